@@ -0,0 +1,107 @@
+#include <string.h>
+#include "chksum.h"
+
+/* header blocks are summed and checked with SSE2 on x86, or AVX2
+ * when the cpu has it, and a word at a time everywhere else or when
+ * built with NO_SIMD */
+#if !defined(NO_SIMD) \
+    && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define HAVE_SSE2
+#endif
+
+#define SUM_BLOCK 512
+
+#ifndef HAVE_SSE2
+/* add up 8 bytes at a time, two bytes to a 16 bit lane. a lane
+ * holds at most 64 * 2 * 255, so it can't overflow in one block */
+static uint32_t sum_words(const unsigned char *block) {
+    const uint64_t low_bytes = (uint64_t) 0x00ff00ffUL << 32 | 0x00ff00ffUL;
+    uint64_t acc = 0;
+    uint64_t w;
+    int i;
+
+    for (i = 0; i < SUM_BLOCK; i += 8) {
+        memcpy(&w, block + i, 8);
+        acc += (w & low_bytes) + ((w >> 8) & low_bytes);
+    }
+    return (acc & 0xffff) + ((acc >> 16) & 0xffff)
+           + ((acc >> 32) & 0xffff) + (acc >> 48);
+}
+
+static int is_octal_byte(unsigned char c) {
+    return (c >= '0' && c <= '7') || c == ' ' || c == '\0';
+}
+#else
+static uint32_t sum_sse2(const unsigned char *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    int i;
+
+    /* psadbw sums each 8 bytes into a 64 bit lane */
+    for (i = 0; i < SUM_BLOCK; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(
+            _mm_loadu_si128((const __m128i *) (block + i)), zero));
+    }
+    return _mm_cvtsi128_si32(acc)
+           + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+__attribute__ ((target("avx2")))
+static uint32_t sum_avx2(const unsigned char *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    __m128i half;
+    int i;
+
+    for (i = 0; i < SUM_BLOCK; i += 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+            _mm256_loadu_si256((const __m256i *) (block + i)), zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                         _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(half)
+           + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+}
+
+/* 16 bits, one for each byte at p that's octal, a space or a nul */
+static unsigned octal_bits(const unsigned char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    /* c - '0' is at most 7, unsigned, for a digit */
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i ok = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(7)), d);
+
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return _mm_movemask_epi8(ok);
+}
+#endif
+
+uint32_t block_sum(const unsigned char *block) {
+#ifdef HAVE_SSE2
+    if (__builtin_cpu_supports("avx2")) {
+        return sum_avx2(block);
+    }
+    return sum_sse2(block);
+#else
+    return sum_words(block);
+#endif
+}
+
+uint64_t octal_mask(const unsigned char *p) {
+    uint64_t bad = 0;
+    int i;
+
+#ifdef HAVE_SSE2
+    for (i = 0; i < 64; i += 16) {
+        bad |= (uint64_t) (~octal_bits(p + i) & 0xffff) << i;
+    }
+#else
+    for (i = 0; i < 64; i++) {
+        if (!is_octal_byte(p[i])) {
+            bad |= (uint64_t) 1 << i;
+        }
+    }
+#endif
+    return bad;
+}
@@ -0,0 +1,14 @@
+#ifndef ASGN4_CHKSUM_H
+#define ASGN4_CHKSUM_H
+
+#include <stdint.h>
+
+/* the unsigned sum of a 512 byte block. only an all zero block
+ * sums to 0 */
+uint32_t block_sum(const unsigned char *block);
+
+/* a bit for each of the 64 bytes at p that isn't an octal digit, a
+ * space or a nul, bit 0 for p[0] */
+uint64_t octal_mask(const unsigned char *p);
+
+#endif
@@ -0,0 +1,1129 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "codec.h"
+#include "io.h"
+
+#define CODEC_BUFSIZE (256 * 1024)
+#define FILTER_PIPE_SIZE (1024 * 1024)
+#define GZIP_LEVEL 6
+#define GZIP_WINDOW (15 + 16)
+#define GZIP_ANY_WINDOW (15 + 32)
+#define GZIP_RAW_WINDOW (-15)
+#define GZIP_FRAME_HEADER 24
+#define GZIP_TRAILER 8
+#define ZSTD_LEVEL 3
+#define ZSTD_SKIP_MAGIC 0x184D2A5DUL
+#define ZSTD_FRAME_HEADER 16
+#define GZIP_META_HEADER 16
+#define GZIP_META_TAIL 10
+#define GZIP_META_MAX (65535 - 4)
+#define ZSTD_META_MAGIC 0x184D2A5EUL
+#define ZSTD_META_HEADER 8
+#define ZSTD_META_MAX (1024 * 1024)
+
+/* the frame table ends with a footer of this magic, the table's
+ * offset and its number of entries */
+#define TABLE_MAGIC "mytarftb"
+#define TABLE_MAGIC_SIZE 8
+#define TABLE_FOOTER_SIZE (TABLE_MAGIC_SIZE + 16)
+#define TABLE_ENTRY_SIZE 16
+
+/* uncompressed bytes per frame */
+#define FRAME_SIZE (1024 * 1024)
+/* frames in flight per thread */
+#define FRAMES_PER_THREAD 2
+/* largest frame a reader will accept */
+#define MAX_FRAME (64 * 1024 * 1024)
+
+/* a write failed. if that was the reader of a decompressed archive
+ * hanging up because it found the end blocks, it's not an error */
+static int write_failed(void) {
+    if (errno == EPIPE) {
+        return 0;
+    }
+    perror("write");
+    return -1;
+}
+
+static int alloc_buffers(unsigned char **in, unsigned char **out) {
+    *in = malloc(CODEC_BUFSIZE);
+    *out = malloc(CODEC_BUFSIZE);
+    if (*in == NULL || *out == NULL) {
+        perror("malloc");
+        free(*in);
+        free(*out);
+        return -1;
+    }
+    return 0;
+}
+
+/* concatenated gzip members are read back to back, so this also
+ * reads framed archives, just on one thread */
+static int gzip_decompress(int in, const unsigned char *head,
+                           size_t head_len, int out) {
+    z_stream zs;
+    unsigned char *ibuf;
+    unsigned char *obuf;
+    ssize_t n;
+    int ret;
+    int in_member = 0;
+    int status = 0;
+
+    if (alloc_buffers(&ibuf, &obuf) == -1) {
+        return -1;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_ANY_WINDOW) != Z_OK) {
+        fprintf(stderr, "gzip: %s\n", zs.msg ? zs.msg : "init failed");
+        free(ibuf);
+        free(obuf);
+        return -1;
+    }
+    zs.next_in = (unsigned char *) head;
+    zs.avail_in = head_len;
+    for (;;) {
+        if (zs.avail_in == 0) {
+            if ((n = read_some(in, ibuf, CODEC_BUFSIZE)) == -1) {
+                perror("read");
+                status = -1;
+                break;
+            }
+            if (n == 0) {
+                if (in_member) {
+                    fprintf(stderr, "gzip: unexpected end of data\n");
+                    status = -1;
+                }
+                break;
+            }
+            zs.next_in = ibuf;
+            zs.avail_in = n;
+        }
+        zs.next_out = obuf;
+        zs.avail_out = CODEC_BUFSIZE;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "gzip: %s\n", zs.msg ? zs.msg : "bad data");
+            status = -1;
+            break;
+        }
+        if (write_all(out, obuf, CODEC_BUFSIZE - zs.avail_out) == -1) {
+            status = write_failed();
+            break;
+        }
+        in_member = ret != Z_STREAM_END;
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);
+        }
+    }
+    inflateEnd(&zs);
+    free(ibuf);
+    free(obuf);
+    return status;
+}
+
+/* a gzip frame is one gzip member whose header carries an extra
+ * field, subfield "MT", with the member's total length and the
+ * length of the data in it, both 32 bit little endian. gunzip
+ * ignores the field and reads the members back to back */
+static void put_le32(unsigned char *p, unsigned long v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static unsigned long get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((unsigned long) p[2] << 16)
+           | ((unsigned long) p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, off_t v) {
+    put_le32(p, v & 0xffffffffUL);
+    put_le32(p + 4, (v >> 16) >> 16);
+}
+
+static off_t get_le64(const unsigned char *p) {
+    return (off_t) get_le32(p) | ((off_t) get_le32(p + 4) << 16 << 16);
+}
+
+static size_t gzip_frame_bound(size_t len) {
+    return compressBound(len) + GZIP_FRAME_HEADER + GZIP_TRAILER;
+}
+
+static long gzip_compress_frame(const unsigned char *in, size_t len,
+                                unsigned char *out, size_t room) {
+    static const unsigned char head[GZIP_FRAME_HEADER - 8] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255, 12, 0, 'M', 'T', 8, 0
+    };
+    z_stream zs;
+    size_t clen;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, GZIP_RAW_WINDOW, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "gzip: %s\n", zs.msg ? zs.msg : "init failed");
+        return -1;
+    }
+    zs.next_in = (unsigned char *) in;
+    zs.avail_in = len;
+    zs.next_out = out + GZIP_FRAME_HEADER;
+    zs.avail_out = room - GZIP_FRAME_HEADER - GZIP_TRAILER;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "gzip: frame didn't fit\n");
+        deflateEnd(&zs);
+        return -1;
+    }
+    clen = GZIP_FRAME_HEADER + zs.total_out + GZIP_TRAILER;
+    deflateEnd(&zs);
+
+    memcpy(out, head, sizeof(head));
+    put_le32(out + sizeof(head), clen);
+    put_le32(out + sizeof(head) + 4, len);
+    put_le32(out + clen - GZIP_TRAILER, crc32(0, in, len));
+    put_le32(out + clen - 4, len);
+    return clen;
+}
+
+/* a metadata frame is an empty gzip member with the data in
+ * subfield "MI" of its extra field */
+static long gzip_meta_frame(const unsigned char *data, size_t len,
+                            unsigned char *out, size_t room) {
+    static const unsigned char head[GZIP_META_HEADER - 4] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255
+    };
+    /* a final, empty, fixed huffman block, then crc and size of 0 */
+    static const unsigned char tail[GZIP_META_TAIL] = { 3, 0 };
+    size_t clen = GZIP_META_HEADER + len + GZIP_META_TAIL;
+
+    if (len > GZIP_META_MAX || clen > room) {
+        return -1;
+    }
+    memcpy(out, head, sizeof(head));
+    out[10] = (len + 4) & 0xff;
+    out[11] = (len + 4) >> 8;
+    out[12] = 'M';
+    out[13] = 'I';
+    out[14] = len & 0xff;
+    out[15] = len >> 8;
+    memcpy(out + GZIP_META_HEADER, data, len);
+    memcpy(out + GZIP_META_HEADER + len, tail, sizeof(tail));
+    return clen;
+}
+
+static int gzip_meta_data(const unsigned char *frame, size_t len,
+                          const unsigned char **data, size_t *dlen) {
+    if (len < GZIP_META_HEADER + GZIP_META_TAIL || frame[0] != 0x1f
+        || frame[1] != 0x8b || frame[2] != 8 || frame[3] != 4
+        || frame[12] != 'M' || frame[13] != 'I') {
+        return 0;
+    }
+    *data = frame + GZIP_META_HEADER;
+    *dlen = frame[14] | (frame[15] << 8);
+    return GZIP_META_HEADER + *dlen + GZIP_META_TAIL == len;
+}
+
+static int gzip_frame_sizes(const unsigned char *head, size_t *clen,
+                            size_t *ulen) {
+    if (head[0] == 0x1f && head[1] == 0x8b && head[2] == 8
+        && head[3] == 4 && head[12] == 'M' && head[13] == 'I') {
+        *clen = GZIP_META_HEADER + (head[14] | (head[15] << 8))
+                + GZIP_META_TAIL;
+        *ulen = 0;
+        return 1;
+    }
+    if (head[0] != 0x1f || head[1] != 0x8b || head[2] != 8
+        || head[3] != 4 || head[10] != 12 || head[11] != 0
+        || head[12] != 'M' || head[13] != 'T' || head[14] != 8
+        || head[15] != 0) {
+        return 0;
+    }
+    *clen = get_le32(head + 16);
+    *ulen = get_le32(head + 20);
+    return *clen >= GZIP_FRAME_HEADER + GZIP_TRAILER;
+}
+
+static long gzip_decompress_frame(const unsigned char *in, size_t len,
+                                  unsigned char *out, size_t room) {
+    z_stream zs;
+    size_t ulen = get_le32(in + 20);
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (ulen > room || inflateInit2(&zs, GZIP_RAW_WINDOW) != Z_OK) {
+        fprintf(stderr, "gzip: bad frame\n");
+        return -1;
+    }
+    zs.next_in = (unsigned char *) in + GZIP_FRAME_HEADER;
+    zs.avail_in = len - GZIP_FRAME_HEADER - GZIP_TRAILER;
+    zs.next_out = out;
+    zs.avail_out = ulen;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != ulen
+        || crc32(0, out, ulen) != get_le32(in + len - GZIP_TRAILER)) {
+        fprintf(stderr, "gzip: corrupt frame\n");
+        return -1;
+    }
+    return ulen;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_decompress(int in, const unsigned char *head,
+                           size_t head_len, int out) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    unsigned char *ibuf;
+    unsigned char *obuf;
+    size_t ret = 0;
+    ssize_t n = head_len;
+    int status = 0;
+
+    if (dctx == NULL || alloc_buffers(&ibuf, &obuf) == -1) {
+        ZSTD_freeDCtx(dctx);
+        return -1;
+    }
+    input.src = head;
+    input.size = head_len;
+    input.pos = 0;
+    while (status == 0 && n > 0) {
+        do {
+            output.dst = obuf;
+            output.size = CODEC_BUFSIZE;
+            output.pos = 0;
+            ret = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+                status = -1;
+                break;
+            }
+            if (write_all(out, obuf, output.pos) == -1) {
+                status = write_failed();
+                n = 0;
+                break;
+            }
+        } while (input.pos < input.size || output.pos == output.size);
+        if (status == 0 && n > 0
+            && (n = read_some(in, ibuf, CODEC_BUFSIZE)) > 0) {
+            input.src = ibuf;
+            input.size = n;
+            input.pos = 0;
+        }
+    }
+    if (n == -1) {
+        perror("read");
+        status = -1;
+    } else if (status == 0 && ret != 0) {
+        fprintf(stderr, "zstd: unexpected end of data\n");
+        status = -1;
+    }
+    ZSTD_freeDCtx(dctx);
+    free(ibuf);
+    free(obuf);
+    return status;
+}
+/* a zstd frame is a skippable frame holding the lengths, as for
+ * gzip, followed by an ordinary zstd frame */
+static size_t zstd_frame_bound(size_t len) {
+    return ZSTD_compressBound(len) + ZSTD_FRAME_HEADER;
+}
+
+static long zstd_compress_frame(const unsigned char *in, size_t len,
+                                unsigned char *out, size_t room) {
+    size_t n = ZSTD_compress(out + ZSTD_FRAME_HEADER,
+                             room - ZSTD_FRAME_HEADER, in, len, ZSTD_LEVEL);
+
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(n));
+        return -1;
+    }
+    put_le32(out, ZSTD_SKIP_MAGIC);
+    put_le32(out + 4, 8);
+    put_le32(out + 8, n + ZSTD_FRAME_HEADER);
+    put_le32(out + 12, len);
+    return n + ZSTD_FRAME_HEADER;
+}
+
+/* metadata goes in a skippable frame of its own */
+static long zstd_meta_frame(const unsigned char *data, size_t len,
+                            unsigned char *out, size_t room) {
+    if (len > ZSTD_META_MAX || len + ZSTD_META_HEADER > room) {
+        return -1;
+    }
+    put_le32(out, ZSTD_META_MAGIC);
+    put_le32(out + 4, len);
+    memcpy(out + ZSTD_META_HEADER, data, len);
+    return len + ZSTD_META_HEADER;
+}
+
+static int zstd_meta_data(const unsigned char *frame, size_t len,
+                          const unsigned char **data, size_t *dlen) {
+    if (len < ZSTD_META_HEADER || get_le32(frame) != ZSTD_META_MAGIC) {
+        return 0;
+    }
+    *data = frame + ZSTD_META_HEADER;
+    *dlen = get_le32(frame + 4);
+    return *dlen + ZSTD_META_HEADER == len;
+}
+
+static int zstd_frame_sizes(const unsigned char *head, size_t *clen,
+                            size_t *ulen) {
+    if (get_le32(head) == ZSTD_META_MAGIC) {
+        *clen = get_le32(head + 4) + ZSTD_META_HEADER;
+        *ulen = 0;
+        return 1;
+    }
+    if (get_le32(head) != ZSTD_SKIP_MAGIC || get_le32(head + 4) != 8) {
+        return 0;
+    }
+    *clen = get_le32(head + 8);
+    *ulen = get_le32(head + 12);
+    return *clen > ZSTD_FRAME_HEADER;
+}
+
+static long zstd_decompress_frame(const unsigned char *in, size_t len,
+                                  unsigned char *out, size_t room) {
+    size_t n = ZSTD_decompress(out, room, in + ZSTD_FRAME_HEADER,
+                               len - ZSTD_FRAME_HEADER);
+
+    if (ZSTD_isError(n) || n != get_le32(in + 12)) {
+        fprintf(stderr, "zstd: corrupt frame\n");
+        return -1;
+    }
+    return n;
+}
+#endif
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+#ifdef HAVE_ZSTD
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+#endif
+
+static const codec codecs[] = {
+    { "gzip", gzip_magic, sizeof(gzip_magic), gzip_decompress,
+      GZIP_FRAME_HEADER, gzip_frame_bound, gzip_compress_frame,
+      gzip_decompress_frame, gzip_frame_sizes,
+      GZIP_META_HEADER + GZIP_META_TAIL, GZIP_META_MAX,
+      gzip_meta_frame, gzip_meta_data },
+#ifdef HAVE_ZSTD
+    { "zstd", zstd_magic, sizeof(zstd_magic), zstd_decompress,
+      ZSTD_FRAME_HEADER, zstd_frame_bound, zstd_compress_frame,
+      zstd_decompress_frame, zstd_frame_sizes,
+      ZSTD_META_HEADER, ZSTD_META_MAX,
+      zstd_meta_frame, zstd_meta_data },
+#endif
+    { NULL, NULL, 0, NULL, 0, NULL, NULL, NULL, NULL, 0, 0, NULL, NULL }
+};
+
+const codec *find_codec(const char *name) {
+    int i;
+
+    for (i = 0; codecs[i].name != NULL; i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+/* which codec, if any, wrote a stream starting with buf */
+const codec *detect_codec(const unsigned char *buf, int len) {
+    int i;
+
+    size_t clen;
+    size_t ulen;
+
+    for (i = 0; codecs[i].name != NULL; i++) {
+        if (len >= codecs[i].magic_len
+            && memcmp(buf, codecs[i].magic, codecs[i].magic_len) == 0) {
+            return &codecs[i];
+        }
+        if (len >= codecs[i].frame_header_len
+            && codecs[i].frame_sizes(buf, &clen, &ulen)) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+/* a frame moving through the pool */
+#define SLOT_EMPTY 0
+#define SLOT_FILLED 1
+#define SLOT_WORKING 2
+#define SLOT_DONE 3
+
+typedef struct
+{
+        /* where the frame's data starts in the uncompressed stream */
+        off_t uoff;
+        unsigned char *in;
+        size_t in_room;
+        size_t in_len;
+        unsigned char *out;
+        size_t out_room;
+        size_t out_len;
+        int state;
+} frame_slot;
+
+/* the filter thread cuts its input into frames, worker threads
+ * (de)compress them in any order, and a writer thread puts them out
+ * in order. one lock covers it all, there's a frame's worth of work
+ * between each time it's taken */
+struct frame_pool
+{
+        filter *f;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        frame_slot *slots;
+        int nslots;
+        /* frames handed out and frames written so far */
+        long filled;
+        long written;
+        /* no more frames are coming */
+        int eof;
+        /* stop early, after a failure or the reader hanging up */
+        int stop;
+        pthread_t *workers;
+        pthread_t writer;
+        /* compressing: member boundaries marked by the writer, from
+         * marks[first] on, and input read past the last frame cut */
+        off_t *marks;
+        long first;
+        long nmarks;
+        long mark_room;
+        unsigned char *carry;
+        size_t carry_len;
+        /* compressing: where each frame was written */
+        frame_table table;
+        long table_room;
+        off_t coff;
+};
+
+/* make sure a slot's buffer holds len bytes */
+static int slot_room(unsigned char **buf, size_t *room, size_t len) {
+    unsigned char *grown;
+
+    if (*room >= len) {
+        return 0;
+    }
+    if ((grown = realloc(*buf, len)) == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    *buf = grown;
+    *room = len;
+    return 0;
+}
+
+static void pool_fail(frame_pool *p, int status) {
+    pthread_mutex_lock(&p->lock);
+    if (status != 0) {
+        p->f->status = status;
+    }
+    p->stop = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *frame_worker(void *arg) {
+    frame_pool *p = arg;
+    const codec *c = p->f->codec;
+    frame_slot *s;
+    long i;
+    long n;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        s = NULL;
+        for (i = p->written; i < p->filled && !p->stop; i++) {
+            if (p->slots[i % p->nslots].state == SLOT_FILLED) {
+                s = &p->slots[i % p->nslots];
+                break;
+            }
+        }
+        if (s == NULL) {
+            if (p->stop || p->eof) {
+                break;
+            }
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        s->state = SLOT_WORKING;
+        pthread_mutex_unlock(&p->lock);
+
+        if (p->f->compress) {
+            n = c->compress_frame(s->in, s->in_len, s->out, s->out_room);
+        } else {
+            n = c->decompress_frame(s->in, s->in_len, s->out, s->out_room);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (n == -1) {
+            p->f->status = -1;
+            p->stop = 1;
+        } else {
+            s->out_len = n;
+            s->state = SLOT_DONE;
+        }
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* note that the next frame written holds data from uoff on */
+static int add_frame(frame_pool *p, off_t uoff) {
+    frame_entry *grown;
+
+    if (p->table.count == p->table_room) {
+        p->table_room = p->table_room ? p->table_room * 2 : 64;
+        grown = realloc(p->table.frames,
+                        p->table_room * sizeof(frame_entry));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        p->table.frames = grown;
+    }
+    p->table.frames[p->table.count].uoff = uoff;
+    p->table.frames[p->table.count].coff = p->coff;
+    p->table.count++;
+    return 0;
+}
+
+static void *frame_writer(void *arg) {
+    frame_pool *p = arg;
+    frame_slot *s;
+    int status;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        s = &p->slots[p->written % p->nslots];
+        while (!p->stop && !(p->eof && p->written == p->filled)
+               && !(p->written < p->filled && s->state == SLOT_DONE)) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->stop || p->written == p->filled) {
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (p->f->compress && add_frame(p, s->uoff) == -1) {
+            pool_fail(p, -1);
+            pthread_mutex_lock(&p->lock);
+            break;
+        }
+        if (write_all(p->f->out, s->out, s->out_len) == -1) {
+            status = write_failed();
+            pthread_mutex_lock(&p->lock);
+            if (status != 0) {
+                p->f->status = status;
+            }
+            p->stop = 1;
+            pthread_cond_broadcast(&p->changed);
+            break;
+        }
+        pthread_mutex_lock(&p->lock);
+        p->coff += s->out_len;
+        s->state = SLOT_EMPTY;
+        p->written++;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* length of a frame of len bytes from start, cut at the last marked
+ * boundary inside it. marks before the frame are dropped */
+static size_t cut_frame(frame_pool *p, off_t start, size_t len) {
+    size_t cut = len;
+    off_t mark;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->first < p->nmarks && p->marks[p->first] <= start) {
+        p->first++;
+    }
+    while (p->first < p->nmarks
+           && (mark = p->marks[p->first]) < start + (off_t) len) {
+        cut = mark - start;
+        p->first++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return cut;
+}
+
+/* read the next frame of input into s. returns 1 for a frame, 2 for
+ * one with nothing to decompress, 0 at the end of the input and -1
+ * on failure. when decompressing, input that isn't a frame also
+ * ends the frames, with *rest set and what was read of it left in s
+ * so it can be decompressed as a plain stream, without seeking back
+ * on a pipe */
+static int fill_slot(frame_pool *p, frame_slot *s, off_t *pos,
+                     int *rest) {
+    filter *f = p->f;
+    const codec *c = f->codec;
+    size_t clen;
+    size_t ulen;
+    ssize_t n;
+
+    if (!f->compress) {
+        s->uoff = 0;
+    }
+
+    if (f->compress) {
+        memcpy(s->in, p->carry, p->carry_len);
+        n = read_full(f->in, s->in + p->carry_len,
+                      FRAME_SIZE - p->carry_len);
+        if (n == -1) {
+            perror("read");
+            return -1;
+        }
+        s->uoff = *pos;
+        s->in_len = p->carry_len + n;
+        p->carry_len = 0;
+        /* a full frame ends at the last member that starts in it, so
+         * members can be reached by starting at a frame */
+        if (s->in_len == FRAME_SIZE) {
+            p->carry_len = s->in_len - cut_frame(p, *pos, s->in_len);
+            s->in_len -= p->carry_len;
+            memcpy(p->carry, s->in + s->in_len, p->carry_len);
+        }
+        *pos += s->in_len;
+        return s->in_len > 0;
+    }
+
+    if (slot_room(&s->in, &s->in_room, c->frame_header_len) == -1) {
+        return -1;
+    }
+    if ((n = read_full(f->in, s->in, c->frame_header_len)) == -1) {
+        perror("read");
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (n < c->frame_header_len || !c->frame_sizes(s->in, &clen, &ulen)
+        || clen > MAX_FRAME || ulen > MAX_FRAME) {
+        s->in_len = n;
+        *rest = 1;
+        return 0;
+    }
+    if (slot_room(&s->in, &s->in_room, clen) == -1
+        || slot_room(&s->out, &s->out_room, ulen) == -1) {
+        return -1;
+    }
+    n = read_full(f->in, s->in + c->frame_header_len,
+                  clen - c->frame_header_len);
+    if (n == -1) {
+        perror("read");
+        return -1;
+    }
+    if ((size_t) n != clen - c->frame_header_len) {
+        fprintf(stderr, "%s: unexpected end of data\n", c->name);
+        return -1;
+    }
+    s->in_len = clen;
+    *pos += clen;
+    if (ulen == 0) {
+        /* metadata, nothing to decompress */
+        s->out_len = 0;
+        return 2;
+    }
+    return 1;
+}
+
+/* write out what's in len bytes of data as metadata frames */
+static int write_meta(filter *f, const unsigned char *data, size_t len,
+                      unsigned char *buf, size_t room) {
+    const codec *c = f->codec;
+    size_t chunk;
+    long n;
+
+    do {
+        chunk = len < c->meta_max ? len : c->meta_max;
+        if ((n = c->meta_frame(data, chunk, buf, room)) == -1) {
+            fprintf(stderr, "%s: can't write frame table\n", c->name);
+            return -1;
+        }
+        if (write_all(f->out, buf, n) == -1) {
+            return write_failed();
+        }
+        f->pool->coff += n;
+        data += chunk;
+        len -= chunk;
+    } while (len > 0);
+    return 0;
+}
+
+/* after the last frame, write where every frame starts so a reader
+ * can begin at any of them, then a fixed size footer pointing back
+ * at the table. both are metadata frames, which decompress to
+ * nothing */
+static int write_table(filter *f) {
+    frame_pool *p = f->pool;
+    unsigned char footer[TABLE_FOOTER_SIZE];
+    unsigned char *data;
+    unsigned char *buf;
+    size_t len = p->table.count * TABLE_ENTRY_SIZE;
+    size_t per = f->codec->meta_max / TABLE_ENTRY_SIZE * TABLE_ENTRY_SIZE;
+    size_t room = per + f->codec->meta_overhead;
+    off_t start = p->coff;
+    size_t off;
+    long i;
+    int ret = 0;
+
+    data = malloc(len + 1);
+    buf = malloc(room);
+    if (data == NULL || buf == NULL) {
+        perror("malloc");
+        free(data);
+        free(buf);
+        return -1;
+    }
+    for (i = 0; i < p->table.count; i++) {
+        put_le64(data + i * TABLE_ENTRY_SIZE, p->table.frames[i].uoff);
+        put_le64(data + i * TABLE_ENTRY_SIZE + 8, p->table.frames[i].coff);
+    }
+    /* entries are never split across frames */
+    for (off = 0; off < len && ret == 0; off += per) {
+        ret = write_meta(f, data + off, len - off < per ? len - off : per,
+                         buf, room);
+    }
+    memcpy(footer, TABLE_MAGIC, TABLE_MAGIC_SIZE);
+    put_le64(footer + TABLE_MAGIC_SIZE, start);
+    put_le64(footer + TABLE_MAGIC_SIZE + 8, p->table.count);
+    if (ret == 0) {
+        ret = write_meta(f, footer, sizeof(footer), buf, room);
+    }
+    free(data);
+    free(buf);
+    return ret;
+}
+
+/* the filter thread's side of a pool: hand out frames until the
+ * input runs out, then wait for the workers and writer */
+static void run_pool(filter *f) {
+    frame_pool *p = f->pool;
+    frame_slot *s;
+    off_t pos = 0;
+    int rest = 0;
+    int got = 1;
+    int i;
+
+    /* decompression may start at any frame */
+    if (!f->compress && (pos = lseek(f->in, 0, SEEK_CUR)) == -1) {
+        pos = 0;
+    }
+    while (got > 0) {
+        s = &p->slots[p->filled % p->nslots];
+        pthread_mutex_lock(&p->lock);
+        while (s->state != SLOT_EMPTY && !p->stop) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (p->stop) {
+            break;
+        }
+        if ((got = fill_slot(p, s, &pos, &rest)) > 0) {
+            pthread_mutex_lock(&p->lock);
+            s->state = got == 1 ? SLOT_FILLED : SLOT_DONE;
+            p->filled++;
+            pthread_cond_broadcast(&p->changed);
+            pthread_mutex_unlock(&p->lock);
+        } else if (got == -1) {
+            pool_fail(p, -1);
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->eof = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < f->threads; i++) {
+        pthread_join(p->workers[i], NULL);
+    }
+    pthread_join(p->writer, NULL);
+
+    if (f->compress && !p->stop && write_table(f) == -1) {
+        f->status = -1;
+    }
+
+    /* data that wasn't written in frames is decompressed the slow
+     * way once the frames before it are out */
+    if (rest && !p->stop) {
+        f->status = f->codec->decompress(f->in, s->in, s->in_len, f->out);
+    }
+}
+
+static frame_pool *start_pool(filter *f) {
+    frame_pool *p = calloc(1, sizeof(frame_pool));
+    size_t in_room = FRAME_SIZE;
+    size_t out_room = f->codec->frame_bound(FRAME_SIZE);
+    int i;
+
+    if (p == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (!f->compress) {
+        in_room = f->codec->frame_bound(FRAME_SIZE);
+        out_room = FRAME_SIZE;
+    }
+    p->f = f;
+    p->nslots = f->threads * FRAMES_PER_THREAD + 1;
+    if (f->compress && (p->carry = malloc(FRAME_SIZE)) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if (f->compress && (p->coff = lseek(f->out, 0, SEEK_CUR)) == -1) {
+        p->coff = 0;
+    }
+    p->slots = calloc(p->nslots, sizeof(frame_slot));
+    p->workers = calloc(f->threads, sizeof(pthread_t));
+    if (p->slots == NULL || p->workers == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for (i = 0; i < p->nslots; i++) {
+        if (slot_room(&p->slots[i].in, &p->slots[i].in_room,
+                      in_room) == -1
+            || slot_room(&p->slots[i].out, &p->slots[i].out_room,
+                         out_room) == -1) {
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    for (i = 0; i < f->threads; i++) {
+        if (pthread_create(&p->workers[i], NULL, frame_worker, p) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return NULL;
+        }
+    }
+    if (pthread_create(&p->writer, NULL, frame_writer, p) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        return NULL;
+    }
+    return p;
+}
+
+static void free_pool(frame_pool *p) {
+    int i;
+
+    for (i = 0; i < p->nslots; i++) {
+        free(p->slots[i].in);
+        free(p->slots[i].out);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+    free(p->slots);
+    free(p->workers);
+    free(p->marks);
+    free(p->carry);
+    free(p->table.frames);
+    free(p);
+}
+
+static void *run_filter(void *arg) {
+    filter *f = arg;
+
+    run_pool(f);
+    if (f->compress) {
+        close(f->in);
+    } else {
+        /* the reader sees the end of the archive */
+        close(f->out);
+    }
+    return NULL;
+}
+
+/* run c on threads between fd and a pipe. when compressing, what is
+ * written to the returned fd is compressed into fd. otherwise fd is
+ * decompressed into the returned fd. threads frames are worked on at
+ * once. returns -1 on failure */
+int start_filter(filter *f, const codec *c, int compress, int fd,
+                 int threads) {
+    int p[2];
+
+    if (pipe(p) == -1) {
+        perror("pipe");
+        return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(p[1], F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+#endif
+    /* a reader that stops at the end blocks closes its end early,
+     * which the thread should see as EPIPE rather than a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    f->codec = c;
+    f->compress = compress;
+    f->threads = threads < 1 ? 1 : threads;
+    f->status = 0;
+    if (compress) {
+        f->in = p[0];
+        f->out = fd;
+        f->user = p[1];
+    } else {
+        f->in = fd;
+        f->out = p[1];
+        f->user = p[0];
+    }
+    if ((f->pool = start_pool(f)) == NULL) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    if (pthread_create(&f->thread, NULL, run_filter, f) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    return f->user;
+}
+
+/* close the caller's end and wait for the thread to finish.
+ * returns the codec's status */
+int finish_filter(filter *f) {
+    close(f->user);
+    pthread_join(f->thread, NULL);
+    free_pool(f->pool);
+    return f->status;
+}
+
+/* record that a member starts at pos in the data being compressed.
+ * frames are cut at these so each starts on a member when it can */
+int filter_mark(filter *f, off_t pos) {
+    frame_pool *p = f->pool;
+    off_t *grown;
+    int ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->first > 0 && p->first == p->nmarks) {
+        p->first = p->nmarks = 0;
+    }
+    if (p->nmarks == p->mark_room) {
+        p->mark_room = p->mark_room ? p->mark_room * 2 : 256;
+        grown = realloc(p->marks, p->mark_room * sizeof(off_t));
+        if (grown == NULL) {
+            perror("realloc");
+            ret = -1;
+        } else {
+            p->marks = grown;
+        }
+    }
+    if (ret == 0) {
+        p->marks[p->nmarks++] = pos;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+/* read a metadata frame of c from fd at off. on success *data and
+ * *dlen point into buf and the frame's length is returned */
+static long read_meta(int fd, const codec *c, off_t off,
+                      unsigned char **buf, size_t *room,
+                      const unsigned char **data, size_t *dlen) {
+    size_t clen;
+    size_t ulen;
+
+    if (slot_room(buf, room, c->frame_header_len) == -1
+        || pread(fd, *buf, c->frame_header_len, off)
+           != c->frame_header_len
+        || !c->frame_sizes(*buf, &clen, &ulen) || ulen != 0
+        || clen > MAX_FRAME || slot_room(buf, room, clen) == -1
+        || pread(fd, *buf, clen, off) != (ssize_t) clen
+        || !c->meta_data(*buf, clen, data, dlen)) {
+        return -1;
+    }
+    return clen;
+}
+
+/* load the frame table from the end of the archive compressed with c
+ * on fd. returns 1 if there is one, 0 if not */
+int load_frame_table(int fd, const codec *c, frame_table *t) {
+    struct stat st;
+    unsigned char *buf = NULL;
+    size_t room = 0;
+    const unsigned char *data;
+    size_t dlen;
+    size_t footer = c->meta_overhead + TABLE_FOOTER_SIZE;
+    off_t off;
+    long count;
+    long n;
+    long i;
+
+    t->frames = NULL;
+    t->count = 0;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) footer
+        || read_meta(fd, c, st.st_size - footer, &buf, &room,
+                     &data, &dlen) == -1
+        || dlen != TABLE_FOOTER_SIZE
+        || memcmp(data, TABLE_MAGIC, TABLE_MAGIC_SIZE) != 0) {
+        free(buf);
+        return 0;
+    }
+    off = get_le64(data + TABLE_MAGIC_SIZE);
+    count = get_le64(data + TABLE_MAGIC_SIZE + 8);
+    if (off < 0 || count <= 0 || count > st.st_size / TABLE_ENTRY_SIZE
+        || (t->frames = malloc(count * sizeof(frame_entry))) == NULL) {
+        free(buf);
+        return 0;
+    }
+    while (t->count < count) {
+        n = read_meta(fd, c, off, &buf, &room, &data, &dlen);
+        if (n == -1 || dlen % TABLE_ENTRY_SIZE != 0
+            || (long) (dlen / TABLE_ENTRY_SIZE) > count - t->count) {
+            break;
+        }
+        for (i = 0; i < (long) (dlen / TABLE_ENTRY_SIZE); i++) {
+            t->frames[t->count].uoff = get_le64(data);
+            t->frames[t->count].coff = get_le64(data + 8);
+            data += TABLE_ENTRY_SIZE;
+            t->count++;
+        }
+        off += n;
+    }
+    free(buf);
+    if (t->count != count) {
+        free_frame_table(t);
+        return 0;
+    }
+    return 1;
+}
+
+/* the last frame whose data starts at or before pos */
+const frame_entry *find_frame(const frame_table *t, off_t pos) {
+    long lo = 0;
+    long hi = t->count;
+    long mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (t->frames[mid].uoff <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? NULL : &t->frames[lo - 1];
+}
+
+void free_frame_table(frame_table *t) {
+    free(t->frames);
+    t->frames = NULL;
+    t->count = 0;
+}
@@ -0,0 +1,96 @@
+#ifndef ASGN4_CODEC_H
+#define ASGN4_CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/* a compression format. archives are compressed as independent
+ * frames, each starting with a header of frame_header_len bytes that
+ * gives its compressed and uncompressed lengths, so frames can be
+ * compressed and decompressed on several threads at once. the frames
+ * are still a valid stream for the format's usual tools */
+typedef struct
+{
+        const char *name;
+        /* leading bytes that identify a compressed stream */
+        const unsigned char *magic;
+        int magic_len;
+        /* decompress a stream that wasn't written in frames, moving
+         * the head_len bytes already read of it and then everything
+         * left in in to out. 0 on success, else -1 */
+        int (*decompress)(int in, const unsigned char *head,
+                          size_t head_len, int out);
+        int frame_header_len;
+        /* most bytes compressing len bytes can take */
+        size_t (*frame_bound)(size_t len);
+        /* one frame in memory. return the output length,
+         * or -1 after printing why */
+        long (*compress_frame)(const unsigned char *in, size_t len,
+                               unsigned char *out, size_t room);
+        long (*decompress_frame)(const unsigned char *in, size_t len,
+                                 unsigned char *out, size_t room);
+        /* read a frame header. returns 0 if head doesn't start one */
+        int (*frame_sizes)(const unsigned char *head, size_t *clen,
+                           size_t *ulen);
+        /* metadata frames hold up to meta_max bytes that tools
+         * decompressing the stream skip over. meta_frame wraps data
+         * in one, meta_data finds the data in one, returning 0 if
+         * frame isn't one */
+        int meta_overhead;
+        size_t meta_max;
+        long (*meta_frame)(const unsigned char *data, size_t len,
+                           unsigned char *out, size_t room);
+        int (*meta_data)(const unsigned char *frame, size_t len,
+                         const unsigned char **data, size_t *dlen);
+} codec;
+
+/* where a frame starts in the uncompressed and compressed data */
+typedef struct
+{
+        off_t uoff;
+        off_t coff;
+} frame_entry;
+
+/* every frame of an archive, in order */
+typedef struct
+{
+        frame_entry *frames;
+        long count;
+} frame_table;
+
+typedef struct frame_pool frame_pool;
+
+/* a codec running on its own threads behind a pipe */
+typedef struct
+{
+        pthread_t thread;
+        const codec *codec;
+        int compress;
+        int threads;
+        int in;
+        int out;
+        /* the pipe end handed back to the caller */
+        int user;
+        int status;
+        frame_pool *pool;
+} filter;
+
+const codec *find_codec(const char *name);
+
+const codec *detect_codec(const unsigned char *buf, int len);
+
+int start_filter(filter *f, const codec *c, int compress, int fd,
+                 int threads);
+
+int finish_filter(filter *f);
+
+int filter_mark(filter *f, off_t pos);
+
+int load_frame_table(int fd, const codec *c, frame_table *t);
+
+const frame_entry *find_frame(const frame_table *t, off_t pos);
+
+void free_frame_table(frame_table *t);
+
+#endif
@@ -0,0 +1,89 @@
+#include <string.h>
+#include "hash.h"
+
+/* xxh64's primes, built from halves since -ansi has no long long
+ * constants */
+#define PRIME(hi, lo) ((uint64_t) (hi) << 32 | (uint64_t) (lo))
+#define P1 PRIME(0x9E3779B1UL, 0x85EBCA87UL)
+#define P2 PRIME(0xC2B2AE3DUL, 0x27D4EB4FUL)
+#define P3 PRIME(0x165667B1UL, 0x9E3779F9UL)
+#define P4 PRIME(0x85EBCA77UL, 0xC2B2AE63UL)
+#define P5 PRIME(0x27D4EB2FUL, 0x165667C5UL)
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t mix(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+}
+
+static uint64_t merge(uint64_t acc, uint64_t v) {
+    acc ^= mix(0, v);
+    return acc * P1 + P4;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed) {
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t v3;
+    uint64_t v4;
+    uint64_t h;
+
+    /* four lanes of 8 bytes at a time for anything long */
+    if (len >= 32) {
+        v1 = seed + P1 + P2;
+        v2 = seed + P2;
+        v3 = seed;
+        v4 = seed - P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = mix(v1, read64(p));
+            v2 = mix(v2, read64(p + 8));
+            v3 = mix(v3, read64(p + 16));
+            v4 = mix(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= mix(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+        h ^= read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
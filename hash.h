@@ -0,0 +1,12 @@
+#ifndef ASGN4_HASH_H
+#define ASGN4_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a 64 bit hash of len bytes at p, xxh64 seeded with seed. a long
+ * input can be hashed a piece at a time by passing each piece's hash
+ * in as the next one's seed */
+uint64_t hash64(const void *p, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,47 @@
+#include <errno.h>
+#include <unistd.h>
+#include "io.h"
+
+ssize_t read_some(int fd, void *buf, size_t len) {
+    ssize_t n;
+
+    do {
+        n = read(fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+ssize_t read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if ((n = read_some(fd, p + got, len - got)) == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
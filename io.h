@@ -0,0 +1,18 @@
+#ifndef ASGN4_IO_H
+#define ASGN4_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* read whatever is available, retrying interrupted reads */
+ssize_t read_some(int fd, void *buf, size_t len);
+
+/* read until len bytes arrive or the file ends.
+ * returns the count read, or -1 with errno set on failure */
+ssize_t read_full(int fd, void *buf, size_t len);
+
+/* write all len bytes, retrying interrupted and short writes.
+ * returns 0, or -1 with errno set on failure */
+int write_all(int fd, const void *buf, size_t len);
+
+#endif
@@ -1,17 +1,51 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <errno.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <ftw.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "mytar.h"
+#include "codec.h"
+#include "uring.h"
+#include "chksum.h"
+#include "hash.h"
+#include "io.h"
+
+#ifdef ALLOC_STATS
+/* count every allocation made here, printed at exit */
+static long alloc_count = 0;
+
+static void *count_alloc(void *p) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+#define malloc(n) count_alloc(malloc(n))
+#define calloc(n, m) count_alloc(calloc(n, m))
+#define realloc(p, n) count_alloc(realloc(p, n))
+#define strdup(s) count_alloc(strdup(s))
+
+static void print_alloc_count(void) {
+    fprintf(stderr, "mytar: %ld allocations\n", alloc_count);
+}
+#endif
 
 #define NAME_OFFSET 0
 #define MODE_OFFSET 100
@@ -48,9 +82,50 @@
 #define PREFIX_SIZE 155
 
 #define MALLOC_SIZE 500
+/* numeric fields are checked 64 bytes at a time from here */
+#define OCTAL_LOW 96
+#define OCTAL_HIGH 320
 #define BLOCK_SIZE 512
 #define PERMS_SIZE 10
 #define TIME_SIZE 16
+#define COPY_BUFSIZE (64 * 1024)
+#define WORKER_QUEUE_DEPTH 64
+#define MAX_JOBS 256
+/* small files in flight in the io_uring at once */
+#define RING_DEPTH 64
+#define RING_HASH_SIZE 1024
+/* arena chunks are at least this big, and allocations from them
+ * are aligned to ARENA_ALIGN */
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+/* read ahead file data is kept in power of two buffers of at
+ * least DATA_MIN bytes, one spare list per size */
+#define DATA_MIN 512
+#define DATA_CLASSES 40
+#define SCAN_LOOKAHEAD 4096
+#define PREFETCH_BUDGET (32 * 1024 * 1024)
+#define NAME_BUF_SIZE 4096
+#define HASH_CHUNK (64 * 1024)
+#define MAGIC_SNIFF_SIZE 32
+/* headers t has asked the kernel for ahead of the one it's on */
+#define LIST_AHEAD 32
+/* archives that can't be mapped are read ahead this far, a chunk
+ * at a time */
+#define READ_AHEAD_SIZE (8 * 1024 * 1024)
+#define READ_AHEAD_CHUNK (1024 * 1024)
+#define ZERO_COPY_MIN (64 * 1024)
+#define ZERO_COPY_CHUNK (1024 * 1024 * 1024)
+/* archives are written a record at a time, records and their
+ * buffer are aligned for O_DIRECT */
+#define RECORD_SIZE (1024 * 1024)
+#define MAX_RECORD (64 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+#define USAGE \
+    "Usage: mytar [ctxiru][z][v][S]f tarfile [-b blocks] [-B bufsize] " \
+    "[-O] [-j jobs] [-Z codec] [-R] [-D] [-g snapshot] [-G] [-N] " \
+    "[-m|-M mtime] [-u uid:gid] [-U user:group] [ path [ ... ] ]\n"
+#define OPTSTRING "b:B:Dg:Gj:NORm:M:u:U:Z:"
 
 typedef struct __attribute__ ((packed))
 {
@@ -74,1144 +149,4722 @@ typedef struct __attribute__ ((packed))
         char padding[12];
 } header;
 
-int f_flag, c_flag, t_flag, x_flag, v_flag, S_flag;
-
-uint32_t extract_special_int(const char *where, int len) {
-    /* For interoperability with GNU tar. GNU seems to
-    * set the high–order bit of the first byte, then
-    * treat the rest of the field as a binary integer
-    * in network byte order.
-    * I don’t know for sure if it’s a 32 or 64–bit int, but for
-    * this version, we’ll only support 32. (well, 31)
-    * returns the integer on success, –1 on failure.
-    * In spite of the name of htonl(), it converts int32 t
-    */
-    int32_t val = -1;
-    if ((len >= sizeof(val)) && (where[0] & 0x80)) {
-        /* the top bit is set, and we have space
-        * extract the last four bytes */
-        val = *(int32_t *) (where + len - sizeof(val));
-        val = ntohl(val); /* convert to host byte order */
-    }
-    return val;
-}
+/* decode_header results */
+#define HDR_OK 0
+#define HDR_END 1
+/* a member that can be listed but not extracted */
+#define HDR_SKIP 2
+#define HDR_BADSUM (-1)
+#define HDR_BADMAGIC (-2)
+#define HDR_BADVERSION (-3)
+#define HDR_BADOCTAL (-4)
+#define HDR_BADPAX (-5)
+
+/* a member header decoded once from its 512 byte block */
+typedef struct
+{
+        /* the header's own fields, copied out below, unless an
+         * extended header gave longer ones. those are interned in
+         * the reader and last until the next member is read */
+        char *path;
+        char *linkname;
+        char *uname;
+        char *gname;
+        char path_buf[PREFIX_SIZE + NAME_SIZE + 2];
+        char link_buf[LINKNAME_SIZE + 1];
+        char uname_buf[UNAME_SIZE + 1];
+        char gname_buf[GNAME_SIZE + 1];
+        char typeflag;
+        long mode;
+        int64_t uid;
+        int64_t gid;
+        int64_t size;
+        int64_t mtime;
+        long mtime_nsec;
+        /* offset of the member's first header, extended or not */
+        off_t offset;
+        /* a pax 1.0 sparse file, whose size bytes of data are a map
+         * of the runs of data followed by the runs themselves */
+        int sparse;
+        /* the size of the file extracted, which is size unless it's
+         * sparse */
+        int64_t realsize;
+} member;
+
+/* a run of data in a sparse file, everything between runs is a hole */
+typedef struct
+{
+        off_t offset;
+        off_t size;
+} sparse_run;
+
+/* what pax extended headers say about the member after them, a
+ * global one's about every member after it. strings are NULL and
+ * numbers -1 when not given */
+typedef struct
+{
+        char *path;
+        char *linkpath;
+        char *uname;
+        char *gname;
+        int64_t uid;
+        int64_t gid;
+        int64_t size;
+        int have_mtime;
+        int64_t mtime;
+        long mtime_nsec;
+        int sparse_major;
+        int sparse_minor;
+        int64_t realsize;
+} pax_info;
+
+/* sidecar index written next to an archive as <tarfile>.idx.
+ * records are sorted by path so lookups are a binary search, and
+ * the archive's size and mtime are kept to detect a stale index.
+ * version 1 indexes could be of archives with global extended
+ * headers, so they're read as stale */
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC "mytaridx"
+#define INDEX_MAGIC_SIZE 8
+#define INDEX_VERSION 2
 
-int insert_special_int(char *where, size_t size, int32_t val) {
-    /* For interoperability with GNU tar. GNU seems to
-    * set the high–order bit of the first byte, then
-    * treat the rest of the field as a binary integer
-    * in network byte order.
-    * Insert the given integer into the given field
-    * using this technique. Returns 0 on success, nonzero
-    * otherwise
-    */
-    int err = 0;
-    if (val < 0 || (size < sizeof(val))) {
-        /* if it’s negative, bit 31 is set and we can’t use the flag
-        * if len is too small, we can’t write it. Either way, we’re
-        * done.
-        */
-        err++;
-    } else {
-        /* game on....*/
-        memset(where, 0, size); /* Clear out the buffer */
-        *(int32_t *) (where + size - sizeof(val)) = htonl(val); /* place the int */
-        *where |= 0x80; /* set that high–order bit */
-    }
-    return err;
-}
+typedef struct __attribute__ ((packed))
+{
+        char magic[INDEX_MAGIC_SIZE];
+        uint32_t version;
+        uint32_t count;
+        uint64_t archive_size;
+        int64_t archive_mtime;
+        int64_t archive_mtime_nsec;
+} index_header;
+
+/* followed by pathlen bytes of nul terminated path */
+typedef struct __attribute__ ((packed))
+{
+        uint64_t offset;
+        uint64_t size;
+        uint32_t pathlen;
+        char typeflag;
+} index_record;
+
+/* an index entry in memory, path points into the loaded file */
+typedef struct
+{
+        off_t offset;
+        off_t size;
+        char typeflag;
+        char *path;
+} idx_entry;
 
-/* extract files from the archive */
-int extract_archive(char *tar_file, char **paths,
-                    int supplied_path, int path_count) {
-    int fd;
-    int new_fd;
-    char *name;
-    char *mode;
-    char *uid;
-    char *gid;
-    char *size;
-    char *mtime;
-    char *chksum;
-    char *typeflag;
-    char *linkname;
-    char *magic;
-    char *version;
-    char *uname;
-    char *gname;
-    char *devmajor;
-    char *devminor;
-    char *prefix;
-    char *contents;
-    int size_read;
-    int file_chunk_size;
-    int converted_mode;
-    int i;
-    int j;
-    int match;
-    int our_sum;
+typedef struct
+{
+        idx_entry *entries;
+        int count;
+        char *data;
+} tar_index;
+
+/* memory handed out from chunks and given back all at once. the
+ * chunks go to a shared pool for the next arena, so work that's
+ * done over and over stops allocating once the pool has warmed up */
+typedef struct arena_chunk
+{
+        struct arena_chunk *next;
+        size_t size;
+        size_t used;
+} arena_chunk;
 
-    /* open the tar file for reading */
-    if ((fd = open(tar_file, O_RDONLY)) == -1) {
-        perror(tar_file);
-        exit(25);
-    }
+typedef struct
+{
+        arena_chunk *head;
+} arena;
 
-    /* save the file chunk size */
-    file_chunk_size = 0;
-    while ((size_read = read(fd, NULL, 512)) != 0) {
-        /*  reset fd back to beginning of block */
-        lseek(fd, -(size_read + 1), SEEK_CUR);
+/* an archive that isn't mapped is read into a ring by a thread of
+ * its own, which stays up to a ring ahead of the reader. head and
+ * tail count every byte read into and taken out of it */
+typedef struct
+{
+        int fd;
+        char *buf;
+        size_t size;
+        off_t head;
+        off_t tail;
+        /* the thread hit the end of the input, or errno if it failed */
+        int eof;
+        int error;
+        int running;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t more;
+        pthread_cond_t room;
+} read_ahead;
+
+/* an archive being listed or extracted */
+typedef struct
+{
+        /* what the archive is read from, the decompressed end
+         * of a pipe when filtered */
+        int fd;
+        /* the archive file itself */
+        int src;
+        int filtered;
+        filter filter;
+        const codec *codec;
+        /* frames of a compressed archive that decompression can
+         * start at, empty if it wasn't written with a table */
+        frame_table frames;
+        int seekable;
+        /* the whole archive if it could be mapped, else NULL */
+        char *map;
+        off_t size;
+        /* offset of the next unread byte */
+        off_t pos;
+        int advice;
+        /* otherwise it comes through here, and headers are
+         * copied out into block */
+        read_ahead ahead;
+        header block;
+        /* what global extended headers have said so far, and
+         * where their strings and the current member's are kept */
+        pax_info global;
+        arena global_mem;
+        arena pax_mem;
+        /* a global header was seen, which a jump by index would miss */
+        int has_global;
+} reader;
+
+/* a regular file waiting for an extraction worker. jobs are kept
+ * for reuse, along with buf, once a worker is done with them */
+typedef struct file_job
+{
+        struct file_job *next;
+        char path[PATH_MAX];
+        mode_t perm;
+        /* into the archive mapping, or buf */
+        const char *data;
+        char *buf;
+        size_t buf_room;
+        off_t size;
+} file_job;
+
+typedef struct
+{
+        pthread_t thread;
+        pthread_mutex_t lock;
+        /* signalled when a job is queued or on shutdown */
+        pthread_cond_t ready;
+        /* signalled when a job is finished */
+        pthread_cond_t room;
+        file_job *head;
+        file_job *tail;
+        /* jobs queued or being written */
+        int depth;
+        int done;
+} worker;
+
+/* a small file written through the io_uring backend */
+typedef struct
+{
+        /* first, so a finished uring_file is its job */
+        uring_file file;
+        char path[PATH_MAX];
+        /* the file's data when the archive isn't mapped */
+        char *buf;
+        unsigned long hash;
+} ring_job;
+
+/* a symlink held back until parallel extraction finishes */
+typedef struct deferred_link
+{
+        struct deferred_link *next;
+        char *path;
+        char *linkname;
+} deferred_link;
+
+/*a file or directory on its way into the archive. scan
+ * workers fill in everything up to ready, then the writer
+ * takes over*/
+typedef struct entry
+{
+        char *path;
+        struct stat st;
+        /*zero if there's no header to write*/
+        int keep;
+        header head;
+        /*contents of a small regular file read ahead*/
+        char *data;
+        off_t dataLen;
+        /*a directory's contents in readdir order,
+ * allocated with their paths from mem*/
+        struct entry *children;
+        int numChildren;
+        arena mem;
+        /*children handed to the workers already*/
+        int queued;
+        int ready;
+        /*data is being read into by the ring*/
+        int reading;
+        /*extended header records for what doesn't fit
+ * in head, from mem*/
+        char *pax;
+        size_t paxLen;
+        /*hash of the contents, for -D*/
+        int hashed;
+        uint64_t hash;
+        /*with -g, the same as in the last snapshot*/
+        int unchanged;
+        /*next on the work queue*/
+        struct entry *next;
+} entry;
+
+/*a -g snapshot of everything archived, so the next run only
+ * archives what's changed since. on disk a snapRecord is followed
+ * by pathlen bytes of nul terminated path, sorted by path*/
+#define SNAP_MAGIC "mytarsnp"
+#define SNAP_MAGIC_SIZE 8
+#define SNAP_VERSION 1
 
-        if (!(name = (char *) malloc(NAME_SIZE))) {
-            perror("malloc:");
-            exit(9);
-        }
+typedef struct __attribute__ ((packed))
+{
+        char magic[SNAP_MAGIC_SIZE];
+        uint32_t version;
+        uint32_t count;
+} snapHeader;
 
-        if (!(mode = malloc(MODE_SIZE))) {
-            perror("malloc:");
-            exit(10);
-        }
+typedef struct __attribute__ ((packed))
+{
+        uint64_t dev;
+        uint64_t ino;
+        uint32_t mode;
+        int64_t size;
+        int64_t mtime;
+        int64_t mtimeNsec;
+        int64_t ctime;
+        int64_t ctimeNsec;
+        uint32_t pathlen;
+} snapRecord;
+
+typedef struct
+{
+        snapRecord rec;
+        char *path;
+} snapEntry;
 
-        if (!(uid = malloc(UID_SIZE))) {
-            perror("malloc:");
-            exit(11);
-        }
+/*a loaded snapshot's paths point into data, a new one's
+ * come from mem*/
+typedef struct
+{
+        snapEntry *entries;
+        int count;
+        int room;
+        char *data;
+        arena mem;
+} snapshot;
+
+/*a regular file already in the archive, by the name it
+ * went in under, for later names of the same file or with
+ * -D later files with the same contents to link to*/
+typedef struct seenFile
+{
+        struct seenFile *next;
+        size_t key;
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        mode_t mode;
+        /*hash of the contents once something needed it*/
+        int hashed;
+        uint64_t hash;
+        char *path;
+} seenFile;
+
+typedef struct
+{
+        seenFile **buckets;
+        size_t size;
+        size_t count;
+        arena mem;
+} fileTable;
+
+/*the archive being written, gathered into records so that
+ * headers, data and padding go out in a few big writes*/
+typedef struct
+{
+        int fd;
+        char *buf;
+        size_t size;
+        size_t used;
+} tarOut;
+
+int f_flag, c_flag, r_flag, u_flag, t_flag, x_flag, i_flag, v_flag, S_flag;
+
+int64_t extract_special_int(const char *where, int len) {
+    /* For interoperability with GNU tar. GNU sets the
+    * high-order bit of the first byte, then treats the
+    * rest of the field as a big endian two's complement
+    * integer, negative when the next bit is set as well.
+    * Fields are at most 12 bytes, anything past 64 bits
+    * is lost.
+    */
+    uint64_t val = where[0] & 0x3f;
+    int i;
 
-        if (!(gid = malloc(GID_SIZE))) {
-            perror("malloc:");
-            exit(12);
+    if (where[0] & 0x40) {
+        /* sign extend from the 7 bits in the first byte */
+        val |= ~(uint64_t) 0x3f;
+    }
+    for (i = 1; i < len; i++) {
+        val = val << 8 | (unsigned char) where[i];
+    }
+    return (int64_t) val;
+}
+int insert_special_int(char *where, size_t size, int64_t val) {
+    /* For interoperability with GNU tar. GNU sets the
+    * high-order bit of the first byte, then treats the
+    * rest of the field as a big endian two's complement
+    * integer. Insert the given integer into the given
+    * field using this technique. Returns 0 on success,
+    * nonzero if it doesn't fit
+    */
+    uint64_t u = (uint64_t) val;
+    int64_t limit;
+    size_t i;
+
+    if (size < 9) {
+        /* one bit for the flag, one for the sign */
+        limit = (int64_t) 1 << (size * 8 - 2);
+        if (val >= limit || val < -limit) {
+            return 1;
         }
-
-        if (!(size = malloc(SIZE_SIZE))) {
-            perror("malloc:");
-            exit(13);
+    }
+    for (i = 0; i < size; i++) {
+        if (i < 8) {
+            where[size - 1 - i] = (char) (u >> (8 * i) & 0xff);
+        } else {
+            where[size - 1 - i] = val < 0 ? (char) 0xff : 0;
         }
+    }
+    if (val >= 0) {
+        *where |= 0x80; /* set that high-order bit */
+    }
+    return 0;
+}
 
-        if (!(mtime = malloc(MTIME_SIZE))) {
-            perror("malloc:");
-            exit(14);
-        }
+/* members up to this many bytes are held whole, to be written by a
+ * worker or through the io_uring or read ahead on create. bigger
+ * ones are streamed. -B changes it */
+size_t copy_bufsize = COPY_BUFSIZE;
+static long page_size = 0;
+
+/* threads extracting files, or scanning ahead of the
+ * archive writer on create. -j changes it */
+int jobs = 1;
+static worker *workers = NULL;
+static int nworkers = 0;
+
+/* with one job, small files are written through an io_uring when
+ * the kernel has one. ring_busy counts the jobs in flight by path
+ * hash so a path is never written twice at once */
+static uring *ring = NULL;
+static ring_job *ring_jobs = NULL;
+static ring_job **ring_free = NULL;
+static int ring_nfree = 0;
+static unsigned char ring_busy[RING_HASH_SIZE];
+static deferred_link *links_head = NULL;
+static deferred_link *links_tail = NULL;
+static arena links_mem = { NULL };
+
+/*the create side's scan workers share one queue*/
+static pthread_mutex_t scanLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scanDone = PTHREAD_COND_INITIALIZER;
+static entry *scanHead = NULL;
+static entry *scanTail = NULL;
+static int scanners = 0;
+static int scanStop = 0;
+/*entries queued but not yet written, and file data held*/
+static long inFlight = 0;
+static long prefetched = 0;
+/*with one job, small files are read a few entries
+ * ahead of the writer through an io_uring instead*/
+static uring *readRing = NULL;
+static uring_file readFiles[RING_DEPTH];
+
+/*reproducible archives: -R sorts directories by name, -m sets
+ * every mtime and -M clamps newer ones, -u and -U replace the
+ * owner ids and names*/
+int sort_names = 0;
+int mtime_mode = 0;
+long mtime_value = 0;
+long owner_uid = -1;
+long owner_gid = -1;
+char *owner_uname = NULL;
+char *owner_gname = NULL;
+/*-N keeps the fraction of a second of each mtime*/
+int subsec_mtime = 0;
+
+/*compress new archives with this, z or -Z picks it*/
+const codec *out_codec = NULL;
+/*the compressor, told where each member
+ * starts so frames can be cut there*/
+filter *tarFilter = NULL;
+off_t tarPos = 0;
+/*records are record_size bytes, -b sets it in blocks and
+ * pads the last one out like tar does. -O writes around
+ * the page cache*/
+static tarOut out = { -1, NULL, 0, 0 };
+size_t record_size = RECORD_SIZE;
+int whole_records = 0;
+int direct_io = 0;
+/*-g: the snapshot file, the last run's snapshot read from
+ * it, and this run's to replace it with*/
+char *snapshot_file = NULL;
+static snapshot oldSnap = { NULL, 0, 0, NULL, { NULL } };
+static snapshot newSnap = { NULL, 0, 0, NULL, { NULL } };
+/*u: oldSnap holds the members already in the archive
+ * instead, and only files that differ from them go in*/
+int update_mode = 0;
+/*-G: on extract, remove what a dumpdir says is gone*/
+int purge_dirs = 0;
+/*-D links files with the same contents as an earlier one*/
+int dedup = 0;
+/*files with more than one link by device and inode, and
+ * with -D every file by size. the scan workers keep the
+ * sizes they've seen under scanLock*/
+static fileTable linkTable = { NULL, 0, 0, { NULL } };
+static fileTable copyTable = { NULL, 0, 0, { NULL } };
+static fileTable scanSizes = { NULL, 0, 0, { NULL } };
+
+/* spare arena chunks, finished extraction jobs, and file data
+ * buffers by size class */
+static arena_chunk *spare_chunks = NULL;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_job *spare_jobs = NULL;
+static void *spare_bufs[DATA_CLASSES];
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
 
-        if (!(chksum = malloc(CHKSUM_SIZE))) {
-            perror("malloc:");
-            exit(15);
+/* n bytes from a, good until a is released */
+static void *arena_alloc(arena *a, size_t n) {
+    arena_chunk *c = a->head;
+    arena_chunk **p;
+    size_t head = align_up(sizeof(arena_chunk));
+
+    n = align_up(n);
+    if (c == NULL || c->size - c->used < n) {
+        /* first spare chunk that's big enough, else a new one */
+        pthread_mutex_lock(&spare_lock);
+        for (p = &spare_chunks; *p != NULL && (*p)->size - head < n;
+             p = &(*p)->next) {
         }
-
-        if (!(typeflag = malloc(TYPEFLAG_SIZE))) {
-            perror("malloc:");
-            exit(16);
+        if ((c = *p) != NULL) {
+            *p = c->next;
         }
-
-        if (!(linkname = malloc(LINKNAME_SIZE))) {
-            perror("malloc:");
-            exit(17);
+        pthread_mutex_unlock(&spare_lock);
+        if (c == NULL) {
+            c = malloc(head + (n > ARENA_CHUNK ? n : ARENA_CHUNK));
+            if (c == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            c->size = head + (n > ARENA_CHUNK ? n : ARENA_CHUNK);
         }
+        c->used = head;
+        c->next = a->head;
+        a->head = c;
+    }
+    c->used += n;
+    return (char *) c + c->used - n;
+}
 
-        if (!(magic = malloc(MAGIC_SIZE))) {
-            perror("malloc:");
-            exit(18);
-        }
+/* give everything allocated from a back to the pool */
+static void arena_release(arena *a) {
+    arena_chunk *c;
 
-        if (!(version = malloc(VERSION_SIZE))) {
-            perror("malloc:");
-            exit(19);
-        }
+    pthread_mutex_lock(&spare_lock);
+    while ((c = a->head) != NULL) {
+        a->head = c->next;
+        c->next = spare_chunks;
+        spare_chunks = c;
+    }
+    pthread_mutex_unlock(&spare_lock);
+}
 
-        if (!(uname = malloc(UNAME_SIZE))) {
-            perror("malloc:");
-            exit(20);
-        }
+/* a finished job to reuse, or a new one */
+static file_job *get_job(void) {
+    file_job *job;
 
-        if (!(gname = malloc(GNAME_SIZE))) {
-            perror("malloc:");
-            exit(21);
+    pthread_mutex_lock(&spare_lock);
+    if ((job = spare_jobs) != NULL) {
+        spare_jobs = job->next;
+    }
+    pthread_mutex_unlock(&spare_lock);
+    if (job == NULL) {
+        if ((job = malloc(sizeof(*job))) == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
+        job->buf = NULL;
+        job->buf_room = 0;
+    }
+    return job;
+}
 
-        if (!(devmajor = malloc(DEVMAJOR_SIZE))) {
-            perror("malloc:");
-            exit(22);
-        }
+static void put_job(file_job *job) {
+    pthread_mutex_lock(&spare_lock);
+    job->next = spare_jobs;
+    spare_jobs = job;
+    pthread_mutex_unlock(&spare_lock);
+}
 
-        if (!(devminor = malloc(DEVMINOR_SIZE))) {
-            perror("malloc:");
-            exit(23);
-        }
+/* the size class of a buffer holding len bytes */
+static int data_class(size_t len) {
+    int c = 0;
 
-        if (!(prefix = malloc(PREFIX_SIZE))) {
-            perror("malloc:");
-            exit(24);
-        }
+    while ((size_t) DATA_MIN << c < len) {
+        c++;
+    }
+    return c;
+}
 
-        if (read(fd, name, NAME_SIZE) == -1) {
-            perror(name);
-            exit(26);
-        }
+/* a buffer with room for len bytes, handed back with put_data */
+static char *get_data(size_t len) {
+    int c = data_class(len);
+    void **buf;
 
-        our_sum = 0;
+    pthread_mutex_lock(&spare_lock);
+    if ((buf = spare_bufs[c]) != NULL) {
+        spare_bufs[c] = *buf;
+    }
+    pthread_mutex_unlock(&spare_lock);
+    if (buf == NULL && (buf = malloc((size_t) DATA_MIN << c)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return (char *) buf;
+}
 
-        /* split the block into appropriate fields with
-         * increment our_sum to verify with chksum */
-        for (i = 0; i < NAME_SIZE; i++) {
-            our_sum += (unsigned char) name[i];
-        }
+static void put_data(char *data, size_t len) {
+    int c = data_class(len);
+    void **buf = (void **) data;
 
-        if (read(fd, mode, MODE_SIZE) == -1) {
-            perror(mode);
-            exit(130);
-        }
-        for (i = 0; i < MODE_SIZE; i++) {
-            our_sum += (unsigned char) mode[i];
-        }
+    pthread_mutex_lock(&spare_lock);
+    *buf = spare_bufs[c];
+    spare_bufs[c] = buf;
+    pthread_mutex_unlock(&spare_lock);
+}
 
-        if (read(fd, uid, UID_SIZE) == -1) {
-            perror(uid);
-            exit(131);
-        }
-        for (i = 0; i < UID_SIZE; i++) {
-            our_sum += (unsigned char) uid[i];
-        }
+/* have the kernel move up to len bytes from in to out without
+ * bringing them into user space: copy_file_range between regular
+ * files (which can share extents on reflink filesystems), sendfile
+ * from a regular file to anything else, and splice when either end
+ * is a pipe. both fd offsets advance as with read and write.
+ * returns the bytes moved, stopping early at end of input or as soon
+ * as the kernel refuses so the caller can finish with plain copies */
+static off_t copy_kernel(int in, int out, off_t len) {
+#ifdef __linux__
+    struct stat ist;
+    struct stat ost;
+    off_t done = 0;
+    ssize_t n = 0;
+    size_t want;
+    int method;
+
+    if (len < ZERO_COPY_MIN || fstat(in, &ist) == -1
+        || fstat(out, &ost) == -1) {
+        return 0;
+    }
+    if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode)) {
+        method = 'c';
+    } else if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)) {
+        method = 'p';
+    } else if (S_ISREG(ist.st_mode)) {
+        method = 's';
+    } else {
+        return 0;
+    }
 
-        if (read(fd, gid, GID_SIZE) == -1) {
-            perror(gid);
-            exit(132);
+    while (done < len) {
+        want = ZERO_COPY_CHUNK;
+        if ((off_t) want > len - done) {
+            want = len - done;
         }
-        for (i = 0; i < GID_SIZE; i++) {
-            our_sum += (unsigned char) gid[i];
-        }
-
-        if (read(fd, size, SIZE_SIZE) == -1) {
-            perror(size);
-            exit(133);
+        if (method == 'c') {
+            n = copy_file_range(in, NULL, out, NULL, want, 0);
+        } else if (method == 's') {
+            n = sendfile(out, in, NULL, want);
+        } else {
+            n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE);
         }
-        for (i = 0; i < SIZE_SIZE; i++) {
-            our_sum += (unsigned char) size[i];
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
-
-        if (read(fd, mtime, MTIME_SIZE) == -1) {
-            perror(mtime);
-            exit(134);
+        if (n == -1 && method == 'c' && done == 0) {
+            /* older kernels refuse cross filesystem copies,
+             * sendfile still avoids the user space copy */
+            method = 's';
+            continue;
         }
-        for (i = 0; i < MTIME_SIZE; i++) {
-            our_sum += (unsigned char) mtime[i];
+        if (n <= 0) {
+            break;
         }
+        done += n;
+    }
+    return done;
+#else
+    return 0;
+#endif
+}
 
-        if (read(fd, chksum, CHKSUM_SIZE) == -1) {
-            perror(mtime);
-            exit(135);
+/* the read ahead thread. it can only be cancelled while it's in
+ * read, so stopping it never leaves the lock held */
+static void *read_ahead_thread(void *arg) {
+    read_ahead *ra = arg;
+    size_t start;
+    size_t len;
+    ssize_t n;
+    int old;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->eof) {
+        if (ra->head - ra->tail == (off_t) ra->size) {
+            pthread_cond_wait(&ra->room, &ra->lock);
+            continue;
         }
-        for (i = 0; i < CHKSUM_SIZE; i++) {
-            our_sum += 32;
+        start = ra->head % ra->size;
+        len = ra->size - (ra->head - ra->tail);
+        if (len > ra->size - start) {
+            len = ra->size - start;
         }
-
-        if (read(fd, typeflag, TYPEFLAG_SIZE) == -1) {
-            perror(typeflag);
-            exit(136);
+        if (len > READ_AHEAD_CHUNK) {
+            len = READ_AHEAD_CHUNK;
         }
-        for (i = 0; i < TYPEFLAG_SIZE; i++) {
-            our_sum += (unsigned char) typeflag[i];
+        pthread_mutex_unlock(&ra->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+        n = read(ra->fd, ra->buf + start, len);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+
+        pthread_mutex_lock(&ra->lock);
+        if (n > 0) {
+            ra->head += n;
+        } else if (n == 0) {
+            ra->eof = 1;
+        } else if (errno != EINTR) {
+            ra->error = errno;
+            ra->eof = 1;
         }
+        pthread_cond_signal(&ra->more);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
 
-        if (read(fd, linkname, LINKNAME_SIZE) == -1) {
-            perror(linkname);
-            exit(137);
-        }
-        for (i = 0; i < LINKNAME_SIZE; i++) {
-            our_sum += (unsigned char) linkname[i];
-        }
+/* start reading fd ahead from where it is now */
+static void ahead_start(read_ahead *ra, int fd) {
+    ra->fd = fd;
+    ra->size = READ_AHEAD_SIZE;
+    ra->head = ra->tail = 0;
+    ra->eof = ra->error = 0;
+    if ((ra->buf = malloc(ra->size)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->more, NULL);
+    pthread_cond_init(&ra->room, NULL);
+    if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(EXIT_FAILURE);
+    }
+    ra->running = 1;
+}
 
-        if (read(fd, magic, MAGIC_SIZE) == -1) {
-            perror(magic);
-            exit(138);
-        }
-        for (i = 0; i < MAGIC_SIZE; i++) {
-            our_sum += (unsigned char) magic[i];
-        }
+/* stop the thread, wherever it is. the fd is left wherever it got
+ * to, past anything still in the ring */
+static void ahead_stop(read_ahead *ra) {
+    if (!ra->running) {
+        return;
+    }
+    pthread_mutex_lock(&ra->lock);
+    ra->eof = 1;
+    pthread_cond_signal(&ra->room);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_cancel(ra->thread);
+    pthread_join(ra->thread, NULL);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->more);
+    pthread_cond_destroy(&ra->room);
+    free(ra->buf);
+    ra->buf = NULL;
+    ra->running = 0;
+}
 
-        if (read(fd, version, VERSION_SIZE) == -1) {
-            perror(version);
-            exit(139);
-        }
-        for (i = 0; i < VERSION_SIZE; i++) {
-            our_sum += (unsigned char) version[i];
-        }
+/* the unread bytes at the tail of the ring, up to len of them in one
+ * piece, waiting for the thread if there are none yet. *n is how
+ * many, 0 only at the end of the input. only this thread moves the
+ * tail, so it can be read without the lock */
+static const char *ahead_peek(read_ahead *ra, off_t len, size_t *n) {
+    size_t start = ra->tail % ra->size;
+    size_t have;
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->head == ra->tail && !ra->eof) {
+        pthread_cond_wait(&ra->more, &ra->lock);
+    }
+    have = ra->head - ra->tail;
+    if (have == 0 && ra->error != 0) {
+        errno = ra->error;
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&ra->lock);
 
-        if (read(fd, uname, UNAME_SIZE) == -1) {
-            perror(uname);
-            exit(140);
-        }
-        for (i = 0; i < UNAME_SIZE; i++) {
-            our_sum += (unsigned char) uname[i];
-        }
+    if (have > ra->size - start) {
+        have = ra->size - start;
+    }
+    if ((off_t) have > len) {
+        have = len;
+    }
+    *n = have;
+    return ra->buf + start;
+}
 
-        if (read(fd, gname, GNAME_SIZE) == -1) {
-            perror(gname);
-            exit(141);
-        }
-        for (i = 0; i < GNAME_SIZE; i++) {
-            our_sum += (unsigned char) gname[i];
-        }
+/* hand n bytes at the tail back to the thread to read into */
+static void ahead_take(read_ahead *ra, size_t n) {
+    pthread_mutex_lock(&ra->lock);
+    ra->tail += n;
+    pthread_cond_signal(&ra->room);
+    pthread_mutex_unlock(&ra->lock);
+}
 
-        if (read(fd, devmajor, DEVMAJOR_SIZE) == -1) {
-            perror(devmajor);
-            exit(142);
-        }
-        for (i = 0; i < DEVMAJOR_SIZE; i++) {
-            our_sum += (unsigned char) devmajor[i];
+/* copy the next len bytes into buf. returns how many there were,
+ * short only at the end of the input */
+static off_t ahead_read(read_ahead *ra, void *buf, off_t len) {
+    const char *p;
+    off_t done = 0;
+    size_t n;
+
+    while (done < len) {
+        p = ahead_peek(ra, len - done, &n);
+        if (n == 0) {
+            break;
         }
+        memcpy((char *) buf + done, p, n);
+        ahead_take(ra, n);
+        done += n;
+    }
+    return done;
+}
 
-        if (read(fd, devminor, DEVMINOR_SIZE) == -1) {
-            perror(devminor);
-            exit(143);
+/* write the next len bytes to out straight from the ring, or just
+ * drop them if out is -1. returns how many there were */
+static off_t ahead_copy(read_ahead *ra, int out, off_t len) {
+    const char *p;
+    off_t done = 0;
+    size_t n;
+
+    while (done < len) {
+        p = ahead_peek(ra, len - done, &n);
+        if (n == 0) {
+            break;
         }
-        for (i = 0; i < DEVMINOR_SIZE; i++) {
-            our_sum += (unsigned char) devminor[i];
+        if (out != -1 && write_all(out, p, n) == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
         }
+        ahead_take(ra, n);
+        done += n;
+    }
+    return done;
+}
 
-        if (read(fd, prefix, PREFIX_SIZE) == -1) {
-            perror(prefix);
-            exit(144);
-        }
-        for (i = 0; i < PREFIX_SIZE; i++) {
-            our_sum += (unsigned char) prefix[i];
-        }
+/* the checksum of a header whose bytes add up to sum, which counts
+ * the chksum field as spaces */
+static uint32_t chksum_of(const header *head, uint32_t sum) {
+    int i;
 
-        /* chksun failed: abort */
-        if ((our_sum) != strtol(chksum, NULL, 8)) {
-            free(name);
-            free(mode);
-            free(uid);
-            free(gid);
-            free(size);
-            free(mtime);
-            free(chksum);
-            free(typeflag);
-            free(linkname);
-            free(magic);
-            free(version);
-            free(uname);
-            free(gname);
-            free(devmajor);
-            free(devminor);
-            exit(150);
-        }
+    for (i = 0; i < CHKSUM_SIZE; i++) {
+        sum += ' ' - (uint8_t) head->chksum[i];
+    }
+    return sum;
+}
 
-        /* go to the next block */
-        lseek(fd, 12, SEEK_CUR);
+static uint32_t header_chksum(const header *head) {
+    return chksum_of(head, block_sum((const unsigned char *) head));
+}
 
-        if (!(contents = malloc((strtol(size, NULL, 8)) + 1))) {
-            perror("malloc:");
-            exit(25);
-        }
+/* check every numeric field holds only octal digits, spaces and
+ * nuls, from a mask of the bytes that don't. a field starting with
+ * the high bit set is a GNU base-256 number, fine unless strict */
+static int numbers_ok(const header *head) {
+    static const struct
+    {
+            int offset;
+            int size;
+    } fields[] = {
+        { MODE_OFFSET, MODE_SIZE }, { UID_OFFSET, UID_SIZE },
+        { GID_OFFSET, GID_SIZE }, { SIZE_OFFSET, SIZE_SIZE },
+        { MTIME_OFFSET, MTIME_SIZE }, { DEVMAJOR_OFFSET, DEVMAJOR_SIZE },
+        { DEVMINOR_OFFSET, DEVMINOR_SIZE }
+    };
+    const unsigned char *block = (const unsigned char *) head;
+    /* mode to chksum sit in bytes 100 to 155, the device
+     * numbers in 329 to 344 */
+    uint64_t low = octal_mask(block + OCTAL_LOW)
+                   & (((uint64_t) 1 << (CHKSUM_OFFSET + CHKSUM_SIZE
+                                        - MODE_OFFSET)) - 1)
+                     << (MODE_OFFSET - OCTAL_LOW);
+    uint64_t high = octal_mask(block + OCTAL_HIGH)
+                    & (((uint64_t) 1 << (DEVMAJOR_SIZE + DEVMINOR_SIZE))
+                       - 1) << (DEVMAJOR_OFFSET - OCTAL_HIGH);
+    uint64_t bits;
+    int i;
 
-        /* read the contents of the file */
-        if (read(fd, contents, (strtol(size, NULL, 8) + 1)) == -1) {
-            perror(contents);
-            exit(145);
+    for (i = 0; !S_flag && i < (int) (sizeof(fields) / sizeof(fields[0]));
+         i++) {
+        if (block[fields[i].offset] & 0x80) {
+            bits = (((uint64_t) 1 << fields[i].size) - 1);
+            if (fields[i].offset < OCTAL_HIGH) {
+                low &= ~(bits << (fields[i].offset - OCTAL_LOW));
+            } else {
+                high &= ~(bits << (fields[i].offset - OCTAL_HIGH));
+            }
         }
+    }
+    return low == 0 && high == 0;
+}
 
+/* parse a numeric header field. fields may fill their whole width
+ * with no terminating nul, and GNU tar stores oversized values
+ * in the base-256 form handled by extract_special_int */
+static int64_t parse_field(const char *field, int len) {
+    uint64_t val = 0;
+    unsigned digit;
+    int i = 0;
 
-        /* concat prefix and name */
-        if(strlen(prefix) != 0) {
-            prefix[strlen(prefix)] = '/';
-        }
-        strcat(prefix, name);
+    if (field[0] & 0x80) {
+        return extract_special_int(field, len);
+    }
+    /* leading spaces, then digits up to a space or nul */
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && (digit = (unsigned char) field[i] - '0') < 8; i++) {
+        val = val << 3 | digit;
+    }
+    return (int64_t) val;
+}
 
-        if (S_flag) {
-            /* if strict mode, ensure magic null terminated
-             * and version is 00
-             */
-            if (memcmp(magic, "ustar\0", MAGIC_SIZE) != 0) {
-                fprintf(stderr, "incorrect magic\n");
-                exit(100);
-            }
-            if (memcmp(version, "00", VERSION_SIZE) != 0) {
-                fprintf(stderr, "incorrect version\n");
-                exit(101);
-            }
-        } else {
-            /* if non-strict, check for ustar */
-            if (memcmp(magic, "ustar", MAGIC_SIZE - 1) != 0) {
-                fprintf(stderr, "incorrect magic\n");
-                exit(102);
-            }
-        }
+/* write val into a numeric field as octal digits and a nul, or as
+ * base-256 when it's negative or too big. returns 1 if it doesn't
+ * fit, which in strict mode is any time it needs base-256 */
+static int put_field(char *field, int size, int64_t val) {
+    int i;
 
-        /* check if a specific path was supplied on the command line */
-        if(supplied_path) {
-            match = 0;
-            for(j = 0; j < path_count; j++) {
-                /* check to see if the
-                 * header file name is a prefix of our target */
-                if(strncmp(prefix, paths[j], strlen(paths[j])) == 0
-                && (prefix[strlen(paths[j])] == '\0'
-                || prefix[strlen(paths[j])] == '/')) {
-                    match = 1;
-                    if (memcmp(typeflag, "0", 1) == 0
-                        || memcmp(typeflag, "\0", 1) == 0) {
-                        /* we have a regular file */
-                        converted_mode = (int) strtol(mode, NULL, 8);
-                        if(((S_IXUSR | S_IXGRP | S_IXOTH)
-                            & converted_mode) != 0) {
-                            /* offer execute perms to everybody */
-                            new_fd = open(name, O_WRONLY | O_CREAT
-                                    , S_IRWXU, S_IRWXG, S_IRWXO);
-                        } else {
-                            new_fd = open(name, O_WRONLY | O_CREAT,
-                                          S_IRUSR | S_IWUSR
-                                          | S_IRGRP | S_IWGRP
-                                          | S_IROTH | S_IWOTH);
-                        }
-                        /* write the contents of the file
-                         * to the newly created file */
-                        write(new_fd, contents, (strtol(size, NULL, 8)));
-                        free(contents);
-                        close(new_fd);
-
-                        /* calculate how far back to lseek */
-                        file_chunk_size = (int)
-                                (strtol(size, NULL, 8) / 512) + 1;
-                        lseek(fd, -(strtol(size, NULL, 8) + 1), SEEK_CUR);
-
-                        /* lseek to next header */
-                        lseek(fd, (512 * file_chunk_size), SEEK_CUR);
-                    } else if (memcmp(typeflag, "5", 1) == 0) {
-                        /* we've found a directory */
-                        mkdir(prefix,
-                              S_IRUSR | S_IWUSR | S_IXUSR
-                              | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-                        lseek(fd, -1, SEEK_CUR);
-                    } else if (memcmp(typeflag, "2", 1) == 0) {
-                        /* symbolic link */
-                        if(symlink(linkname, prefix) == -1) {
-                            perror("symlink");
-                            exit(40);
-                        }
-                        lseek(fd, -1, SEEK_CUR);
-                    } else {
-                        fprintf(stderr, "Unsupported file type supplied\n");
-                    }
-                    /* verbose */
-                    if(v_flag) {
-                        printf("%s\n", prefix);
-                    }
-                }
-            }
-            /* this chunk of the tape was not
-             * targeted by the command line input
-             */
-            if(!match) {
-                /* skip past this */
-                if (memcmp(typeflag, "0", 1) == 0
-                    || memcmp(typeflag, "\0", 1) == 0) {
-                    /* we have a regular file */
-                    file_chunk_size = (int) (strtol(size, NULL, 8) / 512) + 1;
-                    lseek(fd, -(strtol(size, NULL, 8) + 1), SEEK_CUR);
-                    lseek(fd, (512 * file_chunk_size), SEEK_CUR);
-                } else if (memcmp(typeflag, "5", 1) == 0) {
-                    lseek(fd, -1, SEEK_CUR);
-                } else if (memcmp(typeflag, "2", 1) == 0) {
-                    /* symbolic link */
-                    lseek(fd, -1, SEEK_CUR);
-                }
-                free(contents);
-            }
-        } else {
-            /* no targets were supplied on the command line
-             * extract all files
-             */
-            if (memcmp(typeflag, "0", TYPEFLAG_SIZE) == 0
-                || memcmp(typeflag, "\0", TYPEFLAG_SIZE) == 0) {
-                /* we have a regular file */
-                converted_mode = (int) strtol(mode, NULL, 8);
-                if (((S_IXUSR | S_IXGRP | S_IXOTH) & converted_mode) != 0) {
-                    /* offer execute permissions to everybody */
-                    new_fd = open(prefix, O_WRONLY | O_CREAT,
-                                  S_IRWXU, S_IRWXG, S_IRWXO);
-                } else {
-                    /* nobody had execute permissions */
-                    new_fd = open(prefix,
-                                  O_WRONLY | O_CREAT,
-                                  S_IRUSR | S_IWUSR | S_IRGRP
-                                  | S_IWGRP | S_IROTH | S_IWOTH);
-                }
-                write(new_fd, contents, (strtol(size, NULL, 8)));
-                free(contents);
-                close(new_fd);
-                /* calculate how many 512 block chunks this file occupied */
-                file_chunk_size = (int) (strtol(size, NULL, 8) / 512) + 1;
-
-                /* find the next file header */
-                lseek(fd, -(strtol(size, NULL, 8) + 1), SEEK_CUR);
-                lseek(fd, (512 * file_chunk_size), SEEK_CUR);
-            } else if (memcmp(typeflag, "5", TYPEFLAG_SIZE) == 0) {
-                mkdir(prefix, S_IRUSR | S_IWUSR
-                              | S_IXUSR |
-                              S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-                lseek(fd, -1, SEEK_CUR);
-            } else if (memcmp(typeflag, "2", TYPEFLAG_SIZE) == 0) {
-                /* symbolic link */
-                if (symlink(linkname, prefix) == -1) {
-                    perror("symlink");
-                    exit(40);
-                }
-                lseek(fd, -1, SEEK_CUR);
-            } else {
-                fprintf(stderr, "Unsupported file type supplied\n");
-            }
-            /* verbose list files as extracted */
-            if (v_flag) {
-                printf("%s\n", prefix);
-            }
+    if (val >= 0 && (size > 22 || val >> (3 * (size - 1)) == 0)) {
+        field[size - 1] = '\0';
+        for (i = size - 2; i >= 0; i--) {
+            field[i] = '0' + (val & 7);
+            val >>= 3;
         }
-        free(name);
-        free(mode);
-        free(uid);
-        free(gid);
-        free(size);
-        free(mtime);
-        free(chksum);
-        free(typeflag);
-        free(linkname);
-        free(magic);
-        free(version);
-        free(uname);
-        free(gname);
-        free(devmajor);
-        free(devminor);
+        return 0;
     }
-    return 1;
+    return S_flag || insert_special_int(field, size, val);
 }
 
-int print_archive(char *tarfile, char **files, int numFiles) {
-    int fd;
-    /*keep track of the current block we are on*/
-    int blckIndex = 0;
-    char perms[PERMS_SIZE+1] = "-rwxrwxrwx";
-    char rbuff[BLOCK_SIZE];
-    char *endptr;
-    /*put octal strings from strtol into octalstr*/
-    long octalstr = 0;
-    int i =0, j=0;
-    uint32_t chksum = 0;
-    struct tm *time;
-    /*put mtime formatted as a string into this var*/
-    char pbuff[TIME_SIZE+1];
-    char *fname;
+/* decode a header block into m. every field is parsed exactly once
+ * here so neither reader has to go back to the raw block.
+ * returns HDR_OK, HDR_END for the all-zero end-of-archive block,
+ * or one of the negative HDR_BAD* codes after printing why */
+static int decode_header(const header *head, member *m) {
+    uint32_t sum = block_sum((const unsigned char *) head);
+    int i;
+    int j;
 
+    /* an all zero block marks the end of the archive */
+    if (sum == 0) {
+        return HDR_END;
+    }
 
-    if((fd = open(tarfile, O_RDONLY)) == -1){
-        perror("open: tarfile");
-        exit(EXIT_FAILURE);
+    if (chksum_of(head, sum) != (uint32_t) parse_field(head->chksum,
+                                                       CHKSUM_SIZE)) {
+        fprintf(stderr, "invalid chksum\n");
+        return HDR_BADSUM;
     }
 
-    for(;;){
-        if(read(fd, rbuff, BLOCK_SIZE) == -1){
-            perror("read");
-            exit(EXIT_FAILURE);
+    if (memcmp(head->magic, "ustar", MAGIC_SIZE - 1) != 0) {
+        fprintf(stderr, "incorrect magic\n");
+        return HDR_BADMAGIC;
+    }
+    if (S_flag) {
+        /* if strict mode, ensure magic null terminated
+         * and version is 00 */
+        if (head->magic[MAGIC_SIZE - 1] != '\0') {
+            fprintf(stderr, "incorrect magic\n");
+            return HDR_BADMAGIC;
         }
+        if (memcmp(head->version, "00", VERSION_SIZE) != 0) {
+            fprintf(stderr, "incorrect version\n");
+            return HDR_BADVERSION;
+        }
+    }
+    if (!numbers_ok(head)) {
+        fprintf(stderr, "Bad octal strings in header\n");
+        return HDR_BADOCTAL;
+    }
 
-        /*check the magic is "ustar"*/
-        if(strncmp(rbuff+MAGIC_OFFSET, "ustar", 5)){
-                fprintf(stderr, "Magic no. wasn't 'ustar'\n");
-                exit(EXIT_FAILURE);
-            }
-        /*if in strict mode, check magic is null terminated, that the
- * version is 00, and that all ocatal strings are properly formatted*/
-        if(S_flag){
-            if(rbuff[TYPEFLAG_OFFSET-1] != '\0'){
-                fprintf(stderr,
-"Magic # is not null terminated.\n");
-                exit(EXIT_FAILURE);
-            }
-            if(strncmp(rbuff+VERSION_OFFSET, "00", 2)){
-                fprintf(stderr, "Invalid Version #\n");
-                exit(EXIT_FAILURE);
-            }
+    m->path = m->path_buf;
+    m->linkname = m->link_buf;
+    m->uname = m->uname_buf;
+    m->gname = m->gname_buf;
 
-            if((extract_special_int(rbuff+MODE_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+CHKSUM_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+UID_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+GID_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+DEVMAJOR_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+DEVMINOR_OFFSET, 8) != -1) ||
-(extract_special_int(rbuff+SIZE_OFFSET, 12) != -1) ||
-(extract_special_int(rbuff+MTIME_OFFSET, 12) != -1)){
-                fprintf(stderr,"Bad octal strings in header\n");
-                exit(EXIT_FAILURE);
-            }
+    /* join prefix and name into one path */
+    j = 0;
+    if (head->prefix[0] != '\0') {
+        for (i = 0; i < PREFIX_SIZE && head->prefix[i] != '\0'; i++) {
+            m->path[j++] = head->prefix[i];
         }
+        m->path[j++] = '/';
+    }
+    for (i = 0; i < NAME_SIZE && head->name[i] != '\0'; i++) {
+        m->path[j++] = head->name[i];
+    }
+    m->path[j] = '\0';
+
+    memcpy(m->linkname, head->linkname, LINKNAME_SIZE);
+    m->linkname[LINKNAME_SIZE] = '\0';
+    memcpy(m->uname, head->uname, UNAME_SIZE);
+    m->uname[UNAME_SIZE] = '\0';
+    memcpy(m->gname, head->gname, GNAME_SIZE);
+    m->gname[GNAME_SIZE] = '\0';
+
+    /* a nul typeflag is an old style regular file */
+    m->typeflag = head->typeflag[0] == '\0' ? '0' : head->typeflag[0];
+    m->mode = parse_field(head->mode, MODE_SIZE);
+    m->uid = parse_field(head->uid, UID_SIZE);
+    m->gid = parse_field(head->gid, GID_SIZE);
+    m->size = parse_field(head->size, SIZE_SIZE);
+    m->mtime = parse_field(head->mtime, MTIME_SIZE);
+    m->mtime_nsec = 0;
+
+    /* links, devices, fifos and directories have no data blocks
+     * even if a size was recorded. contiguous files are regular */
+    if (strchr("123456", m->typeflag) != NULL) {
+        m->size = 0;
+    } else if (m->typeflag == '7') {
+        m->typeflag = '0';
+    }
+    m->sparse = 0;
+    m->realsize = m->size;
+    return HDR_OK;
+}
 
-        /*get the filename from the
- * header's prefix and name fields*/
-        fname = calloc(PREFIX_SIZE+NAME_SIZE+2, sizeof(char));
-        if(fname == NULL){
-            perror("calloc");
-            exit(EXIT_FAILURE);
-        }
-        /*get prefix if there is one*/
-        if(rbuff[PREFIX_OFFSET] != '\0'){
-            j = snprintf(fname,PREFIX_SIZE+1,
-"%s",rbuff+PREFIX_OFFSET);
-            /*get name field if there
- * is one and put it after prefix*/
-            if(rbuff[NAME_OFFSET] != '\0'){
-               snprintf(fname+j,NAME_SIZE+2,
-"/%s",rbuff+NAME_OFFSET);
-            }
-        } else{
-            snprintf(fname, NAME_SIZE+1, "%s", rbuff+NAME_OFFSET);
-        }
+/* is the member path equal to target or somewhere beneath it */
+static int path_matches(const char *path, const char *target) {
+    size_t len = strlen(target);
 
+    /* "dir/" on the command line should still match "dir/file" */
+    while (len > 1 && target[len - 1] == '/') {
+        len--;
+    }
+    if (strncmp(path, target, len) != 0) {
+        return 0;
+    }
+    return path[len] == '\0' || path[len] == '/';
+}
 
-        /*calculate chksum*/
-        i=0;
-        while(i<BLOCK_SIZE){
-            /*treat the chksum area as 8 spaces*/
-            if(i == CHKSUM_OFFSET){
-                chksum += 32*8;
-                i = TYPEFLAG_OFFSET;
-            }
-            chksum += (uint8_t)rbuff[i++];
+/* number of bytes a payload of size occupies once padded to blocks */
+static off_t padded_size(off_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
 
-        }
-        octalstr = strtol(rbuff+CHKSUM_OFFSET, &endptr, 8);
+/* the codec that compressed the archive open on fd, if any */
+static const codec *sniff_codec(int fd) {
+    unsigned char magic[MAGIC_SNIFF_SIZE];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
 
-        /*if my chksum is 256 but the one in file
- * is 0, we might be at the end or its corrupt*/
-        if(chksum == 256 && octalstr == 0){
-            /*check if end*/
-            if(read(fd, rbuff, BLOCK_SIZE) == -1){
-                perror("read");
-                exit(EXIT_FAILURE);
-            }
-            i = 0;
-            /*if the next block is all 0s
- * stop, otherwise header is corrupt*/
-            while(i<BLOCK_SIZE){
-                if(rbuff[i++] != '\0'){
-                    fprintf(stderr, "invalid chksum");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            close(fd);
-            return 1;
-        /*if chksums differ then corrupt header*/
-        } else if(chksum != octalstr){
-            fprintf(stderr, "invalid chksum");
-            exit(EXIT_FAILURE);
-        }
-        chksum = 0;
+    return n > 0 ? detect_codec(magic, n) : NULL;
+}
 
+/* nothing given yet */
+static void pax_clear(pax_info *pax) {
+    pax->path = pax->linkpath = NULL;
+    pax->uname = pax->gname = NULL;
+    pax->uid = pax->gid = pax->size = -1;
+    pax->have_mtime = 0;
+    pax->sparse_major = pax->sparse_minor = -1;
+    pax->realsize = -1;
+}
 
+/* the codec of an archive coming down the pipe on fd. its first
+ * bytes are duplicated into a pipe of our own with tee, so nothing
+ * is taken from fd */
+static const codec *sniff_pipe(int fd) {
+#ifdef __linux__
+    unsigned char magic[MAGIC_SNIFF_SIZE];
+    struct stat st;
+    ssize_t n;
+    int p[2];
+
+    if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode) || pipe(p) == -1) {
+        return NULL;
+    }
+    do {
+        n = tee(fd, p[1], sizeof(magic), 0);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        n = read(p[0], magic, n);
+    }
+    close(p[0]);
+    close(p[1]);
+    return n > 0 ? detect_codec(magic, n) : NULL;
+#else
+    return NULL;
+#endif
+}
 
+/* map a regular archive so headers are reached by pointer
+ * arithmetic and payloads are written straight from the mapping.
+ * anything that can't be mapped, a pipe or a compressed archive,
+ * is read ahead into a ring by another thread instead.
+ * advice is MADV_SEQUENTIAL when every payload will be read, or
+ * MADV_RANDOM when only headers are wanted so the kernel doesn't
+ * read ahead into data nobody looks at */
+static void open_reader(reader *rd, int fd, int advice) {
+    const codec *c;
+    struct stat st;
+    void *map;
+
+    rd->fd = fd;
+    rd->src = fd;
+    rd->filtered = 0;
+    rd->map = NULL;
+    rd->size = 0;
+    rd->pos = 0;
+    rd->advice = advice;
+    rd->codec = NULL;
+    rd->frames.frames = NULL;
+    rd->frames.count = 0;
+    rd->ahead.running = 0;
+    pax_clear(&rd->global);
+    rd->global_mem.head = NULL;
+    rd->has_global = 0;
+    rd->pax_mem.head = NULL;
+    rd->seekable = lseek(fd, 0, SEEK_CUR) != -1;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
 
-/*check filenames if they are given*/
-        if(numFiles !=0){
-            j = 0;
-            i = 0;
-            while(j<numFiles){
-                i=0;
-                /*keep going until all
- * chars in given filename are read*/
-                while(files[j][i] != '\0'){
-                    /*if strings don't
- * match, check next given file name*/
-                    if(fname[i] != files[j][i]){
-                        break;
-                    }
-                    i++;
-                }
+    /* compressed archives are decompressed on a filter thread
+     * and read back through a pipe */
+    c = rd->seekable ? sniff_codec(fd) : sniff_pipe(fd);
+    if (c != NULL) {
+        if ((rd->fd = start_filter(&rd->filter, c, 0, fd, jobs)) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        rd->filtered = 1;
+        rd->codec = c;
+        if (rd->seekable) {
+            load_frame_table(fd, c, &rd->frames);
+        }
+        rd->seekable = 0;
+    } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+               && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, advice);
+            rd->map = map;
+            rd->size = st.st_size;
+        }
+    }
+    if (rd->map == NULL) {
+        ahead_start(&rd->ahead, rd->fd);
+    }
+}
 
-                /*check if read the whole filename*/
-                /*if i did read the whole filename,
- * is the header name the same*/
-                if( (files[j][i] != '\0') &&
- (fname[i] != '\0' || fname[i] != '/')){
-                    if(++j == numFiles){
-                        i = -1;
-                    }
-                    continue;
-                } else{
-                    break;
-                }
-            }
+static void close_reader(reader *rd) {
+    if (rd->map != NULL) {
+        munmap(rd->map, rd->size);
+    }
+    ahead_stop(&rd->ahead);
+    arena_release(&rd->global_mem);
+    arena_release(&rd->pax_mem);
+    if (rd->filtered && finish_filter(&rd->filter) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    free_frame_table(&rd->frames);
+    close(rd->src);
+}
 
-            /*if we header name wasn't any requested
- * file name or member of a requested directory
- * go to next header by changing the block index*/
-            if(i==-1){
-                blckIndex += 1;
-                octalstr =strtol(rbuff+SIZE_OFFSET, &endptr, 8);
-                blckIndex += octalstr/BLOCK_SIZE;
-                if( (octalstr%BLOCK_SIZE) != 0){
-                    blckIndex += 1;
-                }
-                if(lseek(fd, blckIndex*BLOCK_SIZE,SEEK_SET)
- == -1){
-                    perror("lseek");
-                    exit(EXIT_FAILURE);
-                }
+/* read a seekable archive that isn't mapped from offset on */
+static void restart_reader(reader *rd, off_t offset) {
+    ahead_stop(&rd->ahead);
+    if (lseek(rd->fd, offset, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    ahead_start(&rd->ahead, rd->fd);
+}
 
-                free(fname);
-                /*like a break statement but forces another
- * iteration of a loop instead of forcing termination*/
-                continue;
-            }
+/* the next 512 byte block, or NULL at the end of the archive */
+static const header *next_header(reader *rd) {
+    const header *head;
+    off_t n;
+
+    if (rd->map == NULL) {
+        if ((n = ahead_read(&rd->ahead, &rd->block, BLOCK_SIZE)) == 0) {
+            return NULL;
+        }
+        if (n != BLOCK_SIZE) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(EXIT_FAILURE);
         }
+        rd->pos += BLOCK_SIZE;
+        return &rd->block;
+    }
+    if (rd->pos == rd->size) {
+        return NULL;
+    }
+    if (rd->size - rd->pos < BLOCK_SIZE) {
+        fprintf(stderr, "unexpected end of archive\n");
+        exit(EXIT_FAILURE);
+    }
+    head = (const header *) (rd->map + rd->pos);
+    rd->pos += BLOCK_SIZE;
+    return head;
+}
 
+/* move a compressed reader from from to to by restarting
+ * decompression at the frame holding to. only done when that skips
+ * at least one whole frame, or goes backwards. returns 1 if it did */
+static int jump_frames(reader *rd, off_t from, off_t to) {
+    const frame_entry *dest = find_frame(&rd->frames, to);
+    const frame_entry *cur = find_frame(&rd->frames, from);
 
-        /*do this stuff if we are in verbose mode*/
-        if(v_flag){
-            /*check file type*/
-            if(rbuff[TYPEFLAG_OFFSET] == '5'){
-                perms[0] = 'd';
-            } else if(rbuff[TYPEFLAG_OFFSET] == '2'){
-                perms[0] = 'l';
-            }
+    if (dest == NULL || cur == NULL || (to >= from && dest - cur < 2)) {
+        return 0;
+    }
+    ahead_stop(&rd->ahead);
+    if (finish_filter(&rd->filter) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (lseek(rd->src, dest->coff, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    rd->fd = start_filter(&rd->filter, rd->codec, 0, rd->src, jobs);
+    if (rd->fd == -1) {
+        exit(EXIT_FAILURE);
+    }
+    ahead_start(&rd->ahead, rd->fd);
+    if (ahead_copy(&rd->ahead, -1, to - dest->uoff) != to - dest->uoff) {
+        fprintf(stderr, "unexpected end of archive\n");
+        exit(EXIT_FAILURE);
+    }
+    rd->pos = to;
+    return 1;
+}
 
-            /*check mode bits*/
-            /*probably should have been a switch statement but I
- *          forgot about those and this works*/
-            octalstr = strtol(rbuff+MODE_OFFSET, &endptr, 8);
-            if(  !(octalstr & S_IRUSR)){
-                perms[1] = '-';
-            }
-            if(  !(octalstr & S_IWUSR)){
-                perms[2] = '-';
-            }
-            if(  !(octalstr & S_IXUSR)){
-                perms[3] = '-';
-            }
-            if(  !(octalstr & S_IRGRP)){
-                perms[4] = '-';
+/* start the kernel reading the page with the header at offset in,
+ * without waiting for it, so a walk over headers that knows where
+ * the next few are has reads for all of them in flight at once */
+static void prefetch_header(reader *rd, off_t offset) {
+    off_t page;
+
+    if (rd->map == NULL || offset >= rd->size) {
+        return;
+    }
+    page = offset / page_size * page_size;
+    madvise(rd->map + page, page_size, MADV_WILLNEED);
+}
+
+/* move past len bytes of member data without reading it,
+ * or by reading and dropping it if the input can't seek */
+static void skip_data(reader *rd, off_t len) {
+    rd->pos += len;
+    if (rd->map == NULL) {
+        if (len == 0) {
+            return;
+        }
+        if (rd->filtered && jump_frames(rd, rd->pos - len, rd->pos)) {
+            return;
+        }
+        /* a long way ahead in a file is quicker to seek to than
+         * to read through */
+        if (rd->seekable && len > READ_AHEAD_SIZE) {
+            restart_reader(rd, rd->pos);
+        } else if (ahead_copy(&rd->ahead, -1, len) != len) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (rd->advice == MADV_RANDOM) {
+        prefetch_header(rd, rd->pos);
+    }
+}
+
+/* go to the block at offset, for random access through an index.
+ * a stream can only go forward, which is enough since index hits
+ * are visited in archive order */
+static void seek_reader(reader *rd, off_t offset) {
+    if (rd->map == NULL && !rd->seekable) {
+        if (rd->filtered && jump_frames(rd, rd->pos, offset)) {
+            return;
+        }
+        if (offset < rd->pos) {
+            fprintf(stderr, "can't seek backwards in this archive\n");
+            exit(EXIT_FAILURE);
+        }
+        skip_data(rd, offset - rd->pos);
+        return;
+    }
+    if (rd->map == NULL && offset >= rd->pos) {
+        skip_data(rd, offset - rd->pos);
+        return;
+    }
+    rd->pos = offset;
+    if (rd->map == NULL) {
+        restart_reader(rd, offset);
+    }
+}
+
+/* write len bytes of member data to out, or drop them if out is -1 */
+static void copy_out(reader *rd, int out, off_t len) {
+    if (rd->map == NULL) {
+        if (ahead_copy(&rd->ahead, out, len) != len) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        rd->pos += len;
+        return;
+    }
+    if (rd->size - rd->pos < len) {
+        fprintf(stderr, "unexpected end of archive\n");
+        exit(145);
+    }
+    if (out != -1 && write_all(out, rd->map + rd->pos, len) == -1) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    rd->pos += len;
+}
+
+/* write a member's size bytes of data to out (or drop them if out
+ * is -1) and move past the padding after them */
+static void extract_data(reader *rd, int out, off_t size) {
+    copy_out(rd, out, size);
+    skip_data(rd, padded_size(size) - size);
+}
+
+/* a member's size bytes of data and the padding after them, from
+ * the mapping or read into a buffer that's good until the next call */
+static const char *member_data(reader *rd, off_t size) {
+    static char *buf = NULL;
+    static size_t room = 0;
+    const char *data;
+
+    if (rd->map != NULL) {
+        if (rd->size - rd->pos < size) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        data = rd->map + rd->pos;
+        skip_data(rd, padded_size(size));
+        return data;
+    }
+    if (room < (size_t) size + 1) {
+        free(buf);
+        room = size + 1;
+        if ((buf = malloc(room)) == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (ahead_read(&rd->ahead, buf, size) != size) {
+        fprintf(stderr, "unexpected end of archive\n");
+        exit(145);
+    }
+    rd->pos += size;
+    skip_data(rd, padded_size(size) - size);
+    return buf;
+}
+
+static int pax_key(const char *key, size_t len, const char *want) {
+    return len == strlen(want) && memcmp(key, want, len) == 0;
+}
+
+/* a decimal pax value, -1 if it isn't one */
+static int64_t pax_number(const char *value, size_t len) {
+    int64_t n = 0;
+    size_t i;
+
+    if (len == 0 || len > 18) {
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    return n;
+}
+
+/* len bytes of value interned in mem with a nul after them. an
+ * empty value is NULL, which is how pax takes back a global one */
+static char *pax_string(const char *value, size_t len, arena *mem) {
+    char *str;
+
+    if (len == 0) {
+        return NULL;
+    }
+    str = arena_alloc(mem, len + 1);
+    memcpy(str, value, len);
+    str[len] = '\0';
+    return str;
+}
+
+/* a pax time, decimal seconds with an optional fraction, into sec
+ * and nsec. returns -1 if it isn't one */
+static int pax_time(const char *value, size_t len, int64_t *sec,
+                    long *nsec) {
+    int64_t n = 0;
+    long frac = 0;
+    long scale = 100000000;
+    size_t i = 0;
+    int neg = 0;
+
+    if (len > 0 && value[0] == '-') {
+        neg = 1;
+        i++;
+    }
+    if (i == len || value[i] < '0' || value[i] > '9') {
+        return -1;
+    }
+    for (; i < len && value[i] >= '0' && value[i] <= '9'; i++) {
+        if (n > INT64_MAX / 10 - 9) {
+            return -1;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    if (i < len && value[i] == '.') {
+        for (i++; i < len && value[i] >= '0' && value[i] <= '9'; i++) {
+            frac += (value[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if (i != len) {
+        return -1;
+    }
+    /* -1.25 is a second and a quarter before the epoch */
+    if (neg && frac > 0) {
+        n = -n - 1;
+        frac = 1000000000 - frac;
+    } else if (neg) {
+        n = -n;
+    }
+    *sec = n;
+    *nsec = frac;
+    return 0;
+}
+
+/* take the records of an extended header we know about into pax.
+ * each is "<length> <key>=<value>\n", the length counting itself.
+ * they're parsed where they lie, and only the strings kept are
+ * copied, into mem. returns 0, or -1 if the records are malformed */
+static int parse_pax(const char *data, off_t size, pax_info *pax,
+                     arena *mem) {
+    const char *rec;
+    const char *key;
+    const char *value;
+    size_t len;
+    size_t klen;
+    size_t vlen;
+    off_t pos = 0;
+
+    while (pos < size) {
+        rec = data + pos;
+        len = 0;
+        for (key = rec; key < data + size && *key >= '0' && *key <= '9';
+             key++) {
+            len = len * 10 + (*key - '0');
+        }
+        if (key == rec || key == data + size || *key != ' ' || len == 0
+            || len > (size_t) (size - pos) || rec[len - 1] != '\n') {
+            return -1;
+        }
+        key++;
+        if ((value = memchr(key, '=', rec + len - key)) == NULL) {
+            return -1;
+        }
+        klen = value - key;
+        value++;
+        vlen = rec + len - 1 - value;
+        pos += len;
+
+        if (pax_key(key, klen, "path")
+            || pax_key(key, klen, "GNU.sparse.name")
+            || pax_key(key, klen, "linkpath")) {
+            if (vlen >= PATH_MAX) {
+                fprintf(stderr, "%.*s is too long\n", (int) klen, key);
+                return -1;
             }
-            if(  !(octalstr & S_IWGRP)){
-                perms[5] = '-';
+            if (pax_key(key, klen, "linkpath")) {
+                pax->linkpath = pax_string(value, vlen, mem);
+            } else {
+                pax->path = pax_string(value, vlen, mem);
             }
-            if(  !(octalstr & S_IXGRP)){
-                perms[6] = '-';
+        } else if (pax_key(key, klen, "uname")) {
+            pax->uname = pax_string(value, vlen, mem);
+        } else if (pax_key(key, klen, "gname")) {
+            pax->gname = pax_string(value, vlen, mem);
+        } else if (pax_key(key, klen, "uid")) {
+            pax->uid = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "gid")) {
+            pax->gid = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "size")) {
+            pax->size = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "mtime")) {
+            pax->have_mtime = vlen > 0;
+            if (vlen > 0 && pax_time(value, vlen, &pax->mtime,
+                                     &pax->mtime_nsec) == -1) {
+                return -1;
             }
-            if(  !(octalstr & S_IROTH)){
-                perms[7] = '-';
+        } else if (pax_key(key, klen, "GNU.sparse.major")) {
+            pax->sparse_major = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "GNU.sparse.minor")) {
+            pax->sparse_minor = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "GNU.sparse.realsize")) {
+            pax->realsize = pax_number(value, vlen);
+        } else if (pax_key(key, klen, "GNU.sparse.numblocks")
+                   && pax->sparse_major == -1) {
+            /* the older formats, 0.0 and 0.1, which have no
+             * version of their own. 0.1 puts its map in one record */
+            pax->sparse_major = 0;
+            pax->sparse_minor = 0;
+        } else if (pax_key(key, klen, "GNU.sparse.map")
+                   && pax->sparse_major <= 0) {
+            pax->sparse_major = 0;
+            pax->sparse_minor = 1;
+        }
+    }
+    return 0;
+}
+
+/* decode the next member's headers into m. extended headers are
+ * read and applied to the header after them, global ones to every
+ * header after them, and m->offset is left at the first one.
+ * returns an HDR_ status, HDR_END at the end and HDR_SKIP for a
+ * member whose data can't be made sense of */
+static int read_header(reader *rd, member *m) {
+    const header *head;
+    pax_info pax;
+    off_t offset = rd->pos;
+    int extended = 0;
+    int status;
+
+    /* the last member's strings aren't needed any more */
+    arena_release(&rd->pax_mem);
+    pax = rd->global;
+    for (;;) {
+        if ((head = next_header(rd)) == NULL) {
+            return HDR_END;
+        }
+        if ((status = decode_header(head, m)) != HDR_OK) {
+            return status;
+        }
+        if (m->typeflag != 'x' && m->typeflag != 'g') {
+            break;
+        }
+        if (parse_pax(member_data(rd, m->size), m->size,
+                      m->typeflag == 'g' ? &rd->global : &pax,
+                      m->typeflag == 'g' ? &rd->global_mem
+                      : &rd->pax_mem) == -1) {
+            fprintf(stderr, "bad extended header\n");
+            return HDR_BADPAX;
+        }
+        /* a global header comes before any of a member's own */
+        if (m->typeflag == 'g' && !extended) {
+            pax = rd->global;
+        }
+        extended |= m->typeflag == 'x';
+        rd->has_global |= m->typeflag == 'g';
+    }
+
+    m->offset = offset;
+    if (pax.path != NULL) {
+        m->path = pax.path;
+    }
+    if (pax.linkpath != NULL) {
+        m->linkname = pax.linkpath;
+    }
+    if (pax.uname != NULL) {
+        m->uname = pax.uname;
+    }
+    if (pax.gname != NULL) {
+        m->gname = pax.gname;
+    }
+    if (pax.uid != -1) {
+        m->uid = pax.uid;
+    }
+    if (pax.gid != -1) {
+        m->gid = pax.gid;
+    }
+    if (pax.have_mtime) {
+        m->mtime = pax.mtime;
+        m->mtime_nsec = pax.mtime_nsec;
+    }
+    if (pax.size != -1 && strchr("123456", m->typeflag) == NULL) {
+        m->size = m->realsize = pax.size;
+    }
+    if (pax.sparse_major != -1 && m->typeflag == '0') {
+        if (pax.sparse_major != 1 || pax.sparse_minor != 0
+            || pax.realsize < 0) {
+            fprintf(stderr, "%s: unsupported sparse format %d.%d\n",
+                    m->path, pax.sparse_major, pax.sparse_minor);
+            return HDR_SKIP;
+        }
+        m->sparse = 1;
+        m->realsize = pax.realsize;
+    }
+    return HDR_OK;
+}
+
+/* read the map at the start of a sparse member's data into runs,
+ * a count then an offset and size for each run, in decimal lines
+ * padded out to whole blocks. returns the number of runs and leaves
+ * used at the bytes of data the map took */
+static int read_sparse_map(reader *rd, member *m, sparse_run **runs,
+                           int *room, off_t *used) {
+    const char *block;
+    int64_t value = 0;
+    int64_t count = -1;
+    int digits = 0;
+    int n = 0;
+    int i;
+
+    *used = 0;
+    while (count == -1 || n < count * 2) {
+        if (*used + BLOCK_SIZE > m->size
+            || (block = (const char *) next_header(rd)) == NULL) {
+            fprintf(stderr, "%s: bad sparse map\n", m->path);
+            exit(EXIT_FAILURE);
+        }
+        *used += BLOCK_SIZE;
+        for (i = 0; i < BLOCK_SIZE && (count == -1 || n < count * 2); i++) {
+            if (block[i] >= '0' && block[i] <= '9' && digits < 18) {
+                value = value * 10 + (block[i] - '0');
+                digits++;
+                continue;
             }
-            if(  !(octalstr & S_IWOTH)){
-                perms[8] = '-';
+            if (block[i] != '\n' || digits == 0) {
+                fprintf(stderr, "%s: bad sparse map\n", m->path);
+                exit(EXIT_FAILURE);
             }
-            if(  !(octalstr & S_IXOTH)){
-                perms[9] = '-';
+            if (count == -1) {
+                count = value;
+                if (count > INT_MAX / 2) {
+                    fprintf(stderr, "%s: bad sparse map\n", m->path);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                if (n / 2 == *room) {
+                    *room = *room ? *room * 2 : 64;
+                    *runs = realloc(*runs, *room * sizeof(sparse_run));
+                    if (*runs == NULL) {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                if (n % 2 == 0) {
+                    (*runs)[n / 2].offset = value;
+                } else {
+                    (*runs)[n / 2].size = value;
+                }
+                n++;
             }
+            value = 0;
+            digits = 0;
+        }
+    }
+    return count;
+}
 
-            printf("%s ", perms);
-            strcpy(perms, "-rwxrwxrwx");
-
-            /*uname/gname*/
-            /*if uname or gname not there, use uid & gid*/
-            if( rbuff[UNAME_OFFSET] == '\0'){
-                if(rbuff[UID_OFFSET] == 0x80){
-                    octalstr =
-extract_special_int(rbuff+UID_OFFSET, 8);
-                }else{
-                    octalstr =
-strtol(rbuff+UID_OFFSET, &endptr, 8);
-                }
-                printf("%ld/", octalstr);
-            }else{
-                printf("%s/", rbuff+UNAME_OFFSET);
+/* write a sparse member's runs of data where they belong in out and
+ * leave holes between them, then set the file's real size so a hole
+ * at the end is kept too */
+static void extract_sparse(reader *rd, member *m, int out) {
+    static sparse_run *runs = NULL;
+    static int room = 0;
+    int fd = out;
+    off_t used;
+    int count;
+    int i;
+
+    count = read_sparse_map(rd, m, &runs, &room, &used);
+    for (i = 0; i < count; i++) {
+        if (runs[i].size > m->size - used) {
+            fprintf(stderr, "%s: bad sparse map\n", m->path);
+            exit(EXIT_FAILURE);
+        }
+        if (fd != -1 && lseek(fd, runs[i].offset, SEEK_SET) == -1) {
+            perror(m->path);
+            fd = -1;
+        }
+        copy_out(rd, fd, runs[i].size);
+        used += runs[i].size;
+    }
+    if (fd != -1 && ftruncate(fd, m->realsize) == -1) {
+        perror(m->path);
+    }
+    skip_data(rd, padded_size(m->size) - used);
+}
+
+/* the sidecar index's file name, malloc'ed */
+static char *index_path(const char *tarfile) {
+    char *name = malloc(strlen(tarfile) + strlen(INDEX_SUFFIX) + 1);
+
+    if (name == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(name, tarfile);
+    strcat(name, INDEX_SUFFIX);
+    return name;
+}
+
+/* order entries by path, and by archive position within a path */
+static int compare_entries(const void *a, const void *b) {
+    const idx_entry *x = a;
+    const idx_entry *y = b;
+    int cmp = strcmp(x->path, y->path);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const idx_entry *x = *(idx_entry * const *) a;
+    const idx_entry *y = *(idx_entry * const *) b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* add an index entry for each member from rd's position on */
+static void collect_entries(reader *rd, idx_entry **entries, int *count,
+                            int *room, arena *names) {
+    member m;
+    int status;
+
+    for (;;) {
+        status = read_header(rd, &m);
+        if (status == HDR_END) {
+            break;
+        } else if (status != HDR_OK && status != HDR_SKIP) {
+            exit(EXIT_FAILURE);
+        }
+        if (*count == *room) {
+            *room = *room ? *room * 2 : 256;
+            *entries = realloc(*entries, *room * sizeof(idx_entry));
+            if (*entries == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
             }
-            if( rbuff[GNAME_OFFSET] == '\0'){
-                if(rbuff[GID_OFFSET] == 0x80){
-                    octalstr =
-extract_special_int(rbuff+GID_OFFSET, 8);
-                }else{
-                    octalstr =
-strtol(rbuff+GID_OFFSET, &endptr, 8);
-                }
-                printf("%ld/", octalstr);
-            }else{
-                printf("%s ", rbuff+GNAME_OFFSET);
+        }
+        (*entries)[*count].offset = m.offset;
+        (*entries)[*count].size = m.size;
+        (*entries)[*count].typeflag = m.typeflag;
+        (*entries)[*count].path = arena_alloc(names, strlen(m.path) + 1);
+        strcpy((*entries)[*count].path, m.path);
+        (*count)++;
+        skip_data(rd, padded_size(m.size));
+    }
+}
+
+/* sort entries and write them out as tarfile's index, stamped
+ * with the archive's size and mtime from st */
+static void write_index(const char *tarfile, const struct stat *st,
+                        idx_entry *entries, int count) {
+    index_header ih;
+    index_record rec;
+    char *name;
+    char *tmp;
+    FILE *out;
+    int i;
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+
+    memset(&ih, 0, sizeof(ih));
+    memcpy(ih.magic, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    ih.version = INDEX_VERSION;
+    ih.count = count;
+    ih.archive_size = st->st_size;
+    ih.archive_mtime = st->st_mtim.tv_sec;
+    ih.archive_mtime_nsec = st->st_mtim.tv_nsec;
+
+    /* write a temporary and rename it over the old index so a
+     * reader never sees a half written one */
+    name = index_path(tarfile);
+    if ((tmp = malloc(strlen(name) + 5)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmp, "%s.tmp", name);
+    if ((out = fopen(tmp, "wb")) == NULL) {
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&ih, sizeof(ih), 1, out);
+    for (i = 0; i < count; i++) {
+        rec.offset = entries[i].offset;
+        rec.size = entries[i].size;
+        rec.pathlen = strlen(entries[i].path) + 1;
+        rec.typeflag = entries[i].typeflag;
+        fwrite(&rec, sizeof(rec), 1, out);
+        fwrite(entries[i].path, rec.pathlen, 1, out);
+    }
+    if (fclose(out) == EOF || rename(tmp, name) == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    free(tmp);
+    free(name);
+}
+
+/* remove tarfile's index, if it has one, since it has global
+ * extended headers and going straight to a member would skip them */
+static void drop_index(const char *tarfile) {
+    char *name = index_path(tarfile);
+
+    fprintf(stderr, "%s: has global extended headers, not indexed\n",
+            tarfile);
+    if (unlink(name) == -1 && errno != ENOENT) {
+        perror(name);
+    }
+    free(name);
+}
+
+/* scan the headers of tarfile and write its sidecar index, unless
+ * it has global extended headers an index would skip over */
+int index_archive(char *tarfile) {
+    int fd;
+    reader rd;
+    struct stat st;
+    idx_entry *entries = NULL;
+    int count = 0;
+    int room = 0;
+    arena names = { NULL };
+
+    if ((fd = open(tarfile, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(tarfile);
+        exit(EXIT_FAILURE);
+    }
+    open_reader(&rd, fd, MADV_RANDOM);
+    collect_entries(&rd, &entries, &count, &room, &names);
+    close_reader(&rd);
+    if (rd.has_global) {
+        drop_index(tarfile);
+    } else {
+        write_index(tarfile, &st, entries, count);
+    }
+    free(entries);
+    arena_release(&names);
+    return 1;
+}
+
+/* bring an index that was up to date before members were appended
+ * at from up to date again, reading only the new headers. the old
+ * part had no global extended headers or it wouldn't have been
+ * indexed, but if the new part has one the index goes */
+static void update_index(const char *tarfile, tar_index *idx, off_t from) {
+    int fd;
+    reader rd;
+    struct stat st;
+    idx_entry *entries;
+    int count = idx->count;
+    int room = idx->count + 1;
+    arena names = { NULL };
+
+    if ((fd = open(tarfile, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(tarfile);
+        exit(EXIT_FAILURE);
+    }
+    if ((entries = malloc(room * sizeof(idx_entry))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entries, idx->entries, count * sizeof(idx_entry));
+    open_reader(&rd, fd, MADV_RANDOM);
+    seek_reader(&rd, from);
+    collect_entries(&rd, &entries, &count, &room, &names);
+    close_reader(&rd);
+    if (rd.has_global) {
+        drop_index(tarfile);
+    } else {
+        write_index(tarfile, &st, entries, count);
+    }
+    free(entries);
+    arena_release(&names);
+}
+
+/* the offset of the zero blocks after the last member of the
+ * archive open on fd, where new members can go. with an up to date
+ * index only the last member's header is read, otherwise every
+ * header is, skipping the data in between. each, if given, is
+ * called with every member */
+static off_t archive_end(int fd, tar_index *idx, void (*each)(member *)) {
+    reader rd;
+    member m;
+    off_t end = 0;
+    int status;
+    int i;
+
+    if ((fd = dup(fd)) == -1) {
+        perror("dup");
+        exit(EXIT_FAILURE);
+    }
+    open_reader(&rd, fd, MADV_RANDOM);
+    if (idx != NULL && idx->count > 0) {
+        for (i = 1, end = idx->entries[0].offset; i < idx->count; i++) {
+            if (idx->entries[i].offset > end) {
+                end = idx->entries[i].offset;
             }
+        }
+        seek_reader(&rd, end);
+    }
+    for (;;) {
+        end = rd.pos;
+        status = read_header(&rd, &m);
+        if (status == HDR_END) {
+            break;
+        } else if (status != HDR_OK && status != HDR_SKIP) {
+            exit(EXIT_FAILURE);
+        }
+        if (each != NULL) {
+            each(&m);
+        }
+        skip_data(&rd, padded_size(m.size));
+    }
+    close_reader(&rd);
+    return end;
+}
+
+static void free_index(tar_index *idx) {
+    free(idx->entries);
+    free(idx->data);
+}
+
+/* load tarfile's index if there is one and it was built from the
+ * archive open on fd as it is now. returns 1 if idx is usable */
+static int load_index(const char *tarfile, int fd, tar_index *idx) {
+    char *name = index_path(tarfile);
+    /* standard input never has one */
+    int ifd = strcmp(tarfile, "-") == 0 ? -1 : open(name, O_RDONLY);
+    struct stat ist;
+    struct stat st;
+    index_header ih;
+    index_record rec;
+    size_t pos;
+    int i;
+
+    free(name);
+    idx->entries = NULL;
+    idx->data = NULL;
+    if (ifd == -1) {
+        return 0;
+    }
+    if (fstat(ifd, &ist) == -1 || fstat(fd, &st) == -1
+        || ist.st_size < (off_t) sizeof(ih)
+        || (idx->data = malloc(ist.st_size)) == NULL
+        || read_full(ifd, idx->data, ist.st_size) != ist.st_size) {
+        close(ifd);
+        free_index(idx);
+        return 0;
+    }
+    close(ifd);
+
+    memcpy(&ih, idx->data, sizeof(ih));
+    if (memcmp(ih.magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0
+        || ih.version != INDEX_VERSION
+        || ih.archive_size != (uint64_t) st.st_size
+        || ih.archive_mtime != st.st_mtim.tv_sec
+        || ih.archive_mtime_nsec != st.st_mtim.tv_nsec
+        || (idx->entries = malloc((ih.count + 1)
+                                  * sizeof(idx_entry))) == NULL) {
+        free_index(idx);
+        return 0;
+    }
+
+    /* paths are left in the loaded data rather than copied */
+    pos = sizeof(ih);
+    for (i = 0; i < (int) ih.count; i++) {
+        if (ist.st_size - pos < sizeof(rec)) {
+            break;
+        }
+        memcpy(&rec, idx->data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (rec.pathlen == 0 || ist.st_size - pos < rec.pathlen
+            || idx->data[pos + rec.pathlen - 1] != '\0') {
+            break;
+        }
+        idx->entries[i].offset = rec.offset;
+        idx->entries[i].size = rec.size;
+        idx->entries[i].typeflag = rec.typeflag;
+        idx->entries[i].path = idx->data + pos;
+        pos += rec.pathlen;
+    }
+    if (i != (int) ih.count) {
+        fprintf(stderr, "%s%s: corrupt index, ignoring it\n",
+                tarfile, INDEX_SUFFIX);
+        free_index(idx);
+        return 0;
+    }
+    idx->count = ih.count;
+    return 1;
+}
+
+/* first entry whose path sorts at or after key */
+static int index_lower_bound(tar_index *idx, const char *key) {
+    int lo = 0;
+    int hi = idx->count;
+    int mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(idx->entries[mid].path, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* find the entries path_matches would pick for any of paths, in
+ * archive order with no repeats. *hits is malloc'ed, returns the
+ * number found */
+static int index_lookup(tar_index *idx, char **paths, int path_count,
+                        idx_entry ***hits) {
+    char key[PATH_MAX + 2];
+    size_t len;
+    int nhits = 0;
+    int i;
+    int j;
+
+    if ((*hits = malloc((idx->count + 1) * sizeof(**hits))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (j = 0; j < path_count; j++) {
+        len = strlen(paths[j]);
+        while (len > 1 && paths[j][len - 1] == '/') {
+            len--;
+        }
+        if (len + 2 > sizeof(key)) {
+            continue;
+        }
+        memcpy(key, paths[j], len);
+
+        /* the path itself */
+        key[len] = '\0';
+        for (i = index_lower_bound(idx, key);
+             i < idx->count && strcmp(idx->entries[i].path, key) == 0;
+             i++) {
+            (*hits)[nhits++] = &idx->entries[i];
+        }
+
+        /* and everything below it, which sorts together */
+        key[len] = '/';
+        key[len + 1] = '\0';
+        for (i = index_lower_bound(idx, key);
+             i < idx->count
+             && strncmp(idx->entries[i].path, key, len + 1) == 0;
+             i++) {
+            (*hits)[nhits++] = &idx->entries[i];
+        }
+    }
+
+    /* overlapping paths can find the same entry twice */
+    qsort(*hits, nhits, sizeof(**hits), compare_offsets);
+    for (i = j = 0; i < nhits; i++) {
+        if (j == 0 || (*hits)[j - 1] != (*hits)[i]) {
+            (*hits)[j++] = (*hits)[i];
+        }
+    }
+    return j;
+}
+
+/* every entry in idx, in archive order like index_lookup's hits */
+static int index_all(tar_index *idx, idx_entry ***hits) {
+    int i;
+
+    if ((*hits = malloc((idx->count + 1) * sizeof(**hits))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < idx->count; i++) {
+        (*hits)[i] = &idx->entries[i];
+    }
+    qsort(*hits, idx->count, sizeof(**hits), compare_offsets);
+    return idx->count;
+}
+
+/* called after creating path failed. if that was because a parent
+ * directory is missing (a targeted extract of "dir/sub" never sees
+ * the "dir/" header) make the parents and return 1 so the caller
+ * retries, otherwise return 0 */
+static int make_parents(const char *path) {
+    char dir[PATH_MAX];
+    char *slash;
+
+    if (errno != ENOENT || strlen(path) >= sizeof(dir)) {
+        return 0;
+    }
+    strcpy(dir, path);
+    for (slash = strchr(dir + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1
+            && errno != EEXIST) {
+            return 0;
+        }
+        *slash = '/';
+    }
+    return 1;
+}
+
+/* create (or truncate) a file being extracted.
+ * returns the fd, or -1 after reporting why */
+static int open_output(const char *path, mode_t perm) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, perm);
+
+    if (fd == -1 && make_parents(path)) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, perm);
+    }
+    if (fd == -1) {
+        perror(path);
+    }
+    return fd;
+}
+
+/* give the file already extracted at linkname another name, path.
+ * whatever was at path before goes, as it would if written over */
+static void make_hardlink(const char *linkname, const char *path) {
+    if (link(linkname, path) == 0) {
+        return;
+    }
+    if (errno == EEXIST && unlink(path) == 0 && link(linkname, path) == 0) {
+        return;
+    }
+    if (errno == ENOENT && make_parents(path) && link(linkname, path) == 0) {
+        return;
+    }
+    perror(path);
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag,
+                      struct FTW *ftw) {
+    if (remove(path) == -1) {
+        perror(path);
+    }
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* whether path stays inside the directory we're extracting into:
+ * it isn't absolute, has no "..", and every part of it is a real
+ * directory rather than a symlink to somewhere else */
+static int inside_tree(const char *path) {
+    char dir[PATH_MAX];
+    struct stat st;
+    char *part = dir;
+    char *slash;
+
+    if (path[0] == '/' || strlen(path) >= sizeof(dir)) {
+        return 0;
+    }
+    strcpy(dir, path);
+    for (;;) {
+        if ((slash = strchr(part, '/')) != NULL) {
+            *slash = '\0';
+        }
+        if (strcmp(part, "..") == 0) {
+            return 0;
+        }
+        if (*part != '\0'
+            && (lstat(dir, &st) == -1 || !S_ISDIR(st.st_mode))) {
+            return 0;
+        }
+        if (slash == NULL) {
+            return 1;
+        }
+        *slash = '/';
+        part = slash + 1;
+    }
+}
+
+/* take away everything in directory path that its dumpdir doesn't
+ * list, since it was deleted before the incremental archive was
+ * made. the dumpdir is len bytes of names, each after a one letter
+ * code, ending with an empty one */
+static void purge_dir(const char *path, const char *dump, off_t len) {
+    char full[PATH_MAX + NAME_BUF_SIZE];
+    char **names = NULL;
+    const char *name;
+    struct dirent *de;
+    DIR *dir;
+    int count = 0;
+    int room = 0;
+    off_t pos;
+
+    /* the path is the archive's say so, don't let it
+     * take anything away outside the tree */
+    if (!inside_tree(path)) {
+        fprintf(stderr, "%s: not purging outside the extracted tree\n",
+                path);
+        return;
+    }
+    for (pos = 0; pos < len && dump[pos] != '\0';
+         pos += strlen(dump + pos) + 1) {
+        if (count == room) {
+            room = room ? room * 2 : 64;
+            if ((names = realloc(names, room * sizeof(char *))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        names[count++] = (char *) dump + pos + 1;
+    }
+    if (pos >= len) {
+        fprintf(stderr, "%s: bad dumpdir\n", path);
+        free(names);
+        return;
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+
+    if ((dir = opendir(path)) == NULL) {
+        perror(path);
+        free(names);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        name = de->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")
+            || bsearch(&name, names, count, sizeof(char *),
+                       compare_names) != NULL) {
+            continue;
+        }
+        sprintf(full, "%s%s%s", path,
+                path[strlen(path) - 1] == '/' ? "" : "/", name);
+        if (v_flag) {
+            printf("removing %s\n", full);
+        }
+        nftw(full, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    closedir(dir);
+    free(names);
+}
+
+static void make_symlink(const char *linkname, const char *path) {
+    if (symlink(linkname, path) == -1
+        && (!make_parents(path) || symlink(linkname, path) == -1)) {
+        perror("symlink");
+        exit(40);
+    }
+}
+
+/* parallel extraction (-j). the main thread keeps reading headers
+ * and making directories, and hands regular files to workers. a
+ * file always goes to the worker its path hashes to, so repeated
+ * paths are still written in archive order. symlinks are made
+ * after every worker has finished */
+static void *extract_worker(void *arg) {
+    worker *w = arg;
+    file_job *job;
+    int fd;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL && !w->done) {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+        if ((job = w->head) == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        w->head = job->next;
+        pthread_mutex_unlock(&w->lock);
+
+        if ((fd = open_output(job->path, job->perm)) != -1) {
+            if (write_all(fd, job->data, job->size) == -1) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        put_job(job);
+
+        pthread_mutex_lock(&w->lock);
+        w->depth--;
+        pthread_cond_signal(&w->room);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static void start_workers(int count) {
+    int i;
+
+    if ((workers = calloc(count, sizeof(*workers))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    nworkers = count;
+    for (i = 0; i < count; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].ready, NULL);
+        pthread_cond_init(&workers[i].room, NULL);
+        if (pthread_create(&workers[i].thread, NULL,
+                           extract_worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* wait until every queued file has been written */
+static void drain_workers(void) {
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        while (workers[i].depth > 0) {
+            pthread_cond_wait(&workers[i].room, &workers[i].lock);
+        }
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+}
+
+/* finish the queued files, then make the deferred symlinks */
+static void stop_workers(void) {
+    deferred_link *link;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        workers[i].done = 1;
+        pthread_cond_signal(&workers[i].ready);
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        pthread_cond_destroy(&workers[i].ready);
+        pthread_cond_destroy(&workers[i].room);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+
+    while ((link = links_head) != NULL) {
+        links_head = link->next;
+        make_symlink(link->linkname, link->path);
+    }
+    links_tail = NULL;
+    arena_release(&links_mem);
+}
+
+static unsigned long hash_path(const char *path) {
+    unsigned long h = 5381;
+
+    while (*path != '\0') {
+        h = h * 33 + (unsigned char) *path++;
+    }
+    return h;
+}
+
+/* hand a regular file to its worker. mapped data is written
+ * straight from the mapping. otherwise small files are read into
+ * a buffer for the job, and big ones are written here once the
+ * workers are idle so memory stays bounded */
+static void queue_file(reader *rd, member *m, mode_t perm) {
+    worker *w = &workers[hash_path(m->path) % nworkers];
+    file_job *job;
+    int fd;
+
+    if (rd->map == NULL && m->size > (off_t) copy_bufsize) {
+        drain_workers();
+        fd = open_output(m->path, perm);
+        extract_data(rd, fd, m->size);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    job = get_job();
+    job->next = NULL;
+    strcpy(job->path, m->path);
+    job->perm = perm;
+    job->size = m->size;
+    if (rd->map != NULL) {
+        if (rd->size - rd->pos < m->size) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        job->data = rd->map + rd->pos;
+        skip_data(rd, padded_size(m->size));
+    } else {
+        if (job->buf_room < (size_t) m->size + 1) {
+            free(job->buf);
+            job->buf_room = m->size + 1;
+            if ((job->buf = malloc(job->buf_room)) == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (ahead_read(&rd->ahead, job->buf, m->size) != m->size) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        rd->pos += m->size;
+        skip_data(rd, padded_size(m->size) - m->size);
+        job->data = job->buf;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->depth >= WORKER_QUEUE_DEPTH) {
+        pthread_cond_wait(&w->room, &w->lock);
+    }
+    if (w->head == NULL) {
+        w->head = job;
+    } else {
+        w->tail->next = job;
+    }
+    w->tail = job;
+    w->depth++;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void defer_symlink(member *m) {
+    deferred_link *link;
+    size_t plen = strlen(m->path) + 1;
+
+    link = arena_alloc(&links_mem,
+                       sizeof(*link) + plen + strlen(m->linkname) + 1);
+    link->next = NULL;
+    link->path = (char *) (link + 1);
+    link->linkname = link->path + plen;
+    strcpy(link->path, m->path);
+    strcpy(link->linkname, m->linkname);
+    if (links_tail == NULL) {
+        links_head = link;
+    } else {
+        links_tail->next = link;
+    }
+    links_tail = link;
+}
+
+static void start_ring(void) {
+    int i;
+
+    if ((ring = uring_open(RING_DEPTH)) == NULL) {
+        return;
+    }
+    ring_jobs = calloc(RING_DEPTH, sizeof(*ring_jobs));
+    ring_free = malloc(RING_DEPTH * sizeof(*ring_free));
+    if (ring_jobs == NULL || ring_free == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < RING_DEPTH; i++) {
+        ring_free[i] = &ring_jobs[i];
+    }
+    ring_nfree = RING_DEPTH;
+}
+
+/* deal with a job the ring has finished. a file the ring couldn't
+ * write, for missing parent directories or any other reason, is
+ * written over again the usual way, which reports why if it fails
+ * too */
+static void finish_ring_job(ring_job *job) {
+    uring_file *f = &job->file;
+    int fd;
+
+    if (f->open_res < 0 || f->rw_res != (long) f->len) {
+        if ((fd = open_output(job->path, f->mode)) != -1) {
+            if (write_all(fd, f->buf, f->len) == -1) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+    }
+    ring_busy[job->hash]--;
+    ring_free[ring_nfree++] = job;
+}
+
+/* wait for everything in the ring */
+static void drain_ring(void) {
+    uring_file *f;
+
+    while ((f = uring_wait(ring)) != NULL) {
+        finish_ring_job((ring_job *) f);
+    }
+}
+
+static void stop_ring(void) {
+    int i;
+
+    drain_ring();
+    uring_close(ring);
+    ring = NULL;
+    for (i = 0; i < RING_DEPTH; i++) {
+        free(ring_jobs[i].buf);
+    }
+    free(ring_jobs);
+    free(ring_free);
+}
+
+/* open, write and close a small file as one chain in the ring, which
+ * goes to the kernel along with many others. returns 0 if m is too
+ * big, leaving it to the caller */
+static int ring_file(reader *rd, member *m, mode_t perm) {
+    ring_job *job;
+
+    if (m->size > (off_t) copy_bufsize) {
+        return 0;
+    }
+    if (ring_nfree == 0) {
+        finish_ring_job((ring_job *) uring_wait(ring));
+    }
+    job = ring_free[--ring_nfree];
+    strcpy(job->path, m->path);
+    job->hash = hash_path(m->path) % RING_HASH_SIZE;
+    if (rd->map != NULL) {
+        if (rd->size - rd->pos < m->size) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        job->file.buf = rd->map + rd->pos;
+        skip_data(rd, padded_size(m->size));
+    } else {
+        if (job->buf == NULL && (job->buf = malloc(copy_bufsize)) == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (ahead_read(&rd->ahead, job->buf, m->size) != m->size) {
+            fprintf(stderr, "unexpected end of archive\n");
+            exit(145);
+        }
+        rd->pos += m->size;
+        skip_data(rd, padded_size(m->size) - m->size);
+        job->file.buf = job->buf;
+    }
+    job->file.path = job->path;
+    job->file.flags = O_WRONLY | O_CREAT | O_TRUNC;
+    job->file.mode = perm;
+    job->file.write = 1;
+    job->file.len = m->size;
+    job->file.user = NULL;
+    uring_submit(ring, &job->file);
+    ring_busy[job->hash]++;
+    return 1;
+}
+
+/* recreate one member whose header has been decoded into m,
+ * consuming its data from rd */
+static void extract_member(reader *rd, member *m) {
+    int new_fd;
+    mode_t perm;
+
+    /* never touch a path the ring is still writing */
+    if (ring != NULL && ring_busy[hash_path(m->path) % RING_HASH_SIZE]) {
+        drain_ring();
+    }
+    if (m->typeflag == '0') {
+        /* we have a regular file */
+        if (((S_IXUSR | S_IXGRP | S_IXOTH) & m->mode) != 0) {
+            /* offer execute permissions to everybody */
+            perm = S_IRWXU | S_IRWXG | S_IRWXO;
+        } else {
+            /* nobody had execute permissions */
+            perm = S_IRUSR | S_IWUSR | S_IRGRP
+                   | S_IWGRP | S_IROTH | S_IWOTH;
+        }
+        if (m->sparse) {
+            /* holes are left by seeking, written here once the
+             * workers are done with anything at the same path */
+            if (nworkers > 1) {
+                drain_workers();
+            }
+            new_fd = open_output(m->path, perm);
+            extract_sparse(rd, m, new_fd);
+            if (new_fd != -1) {
+                close(new_fd);
+            }
+        } else if (nworkers > 1) {
+            queue_file(rd, m, perm);
+        } else if (ring != NULL && ring_file(rd, m, perm)) {
+            /* written once the ring gets to it */
+        } else {
+            /* write the contents of the file
+             * to the newly created file */
+            new_fd = open_output(m->path, perm);
+            extract_data(rd, new_fd, m->size);
+            if (new_fd != -1) {
+                close(new_fd);
+            }
+        }
+    } else if (m->typeflag == '5' || m->typeflag == 'D') {
+        /* we've found a directory. always made here, before any
+         * of its children can reach a worker */
+        perm = S_IRUSR | S_IWUSR | S_IXUSR
+               | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+        if (mkdir(m->path, perm) == -1 && make_parents(m->path)) {
+            mkdir(m->path, perm);
+        }
+        /* an incremental archive's directory lists what's in it,
+         * which -G holds the directory to */
+        if (m->typeflag == 'D' && purge_dirs) {
+            purge_dir(m->path, member_data(rd, m->size), m->size);
+        } else if (m->typeflag == 'D') {
+            skip_data(rd, padded_size(m->size));
+        }
+    } else if (m->typeflag == '1') {
+        /* hard link, to a file the workers or the ring may still
+         * be writing */
+        if (nworkers > 1) {
+            drain_workers();
+        }
+        if (ring != NULL) {
+            drain_ring();
+        }
+        make_hardlink(m->linkname, m->path);
+    } else if (m->typeflag == '2') {
+        /* symbolic link */
+        if (nworkers > 1) {
+            defer_symlink(m);
+        } else {
+            make_symlink(m->linkname, m->path);
+        }
+    } else {
+        fprintf(stderr, "Unsupported file type supplied\n");
+        skip_data(rd, padded_size(m->size));
+    }
+
+    /* verbose list files as extracted */
+    if (v_flag) {
+        printf("%s\n", m->path);
+    }
+}
+
+/* decode the header at rd into m, exiting on a bad one.
+ * returns 1 for a member, 2 for one that can't be extracted and
+ * has been stepped over, and 0 at the end of the archive */
+static int next_member(reader *rd, member *m) {
+    int status = read_header(rd, m);
+
+    if (status == HDR_END) {
+        return 0;
+    } else if (status == HDR_SKIP) {
+        skip_data(rd, padded_size(m->size));
+        return 2;
+    } else if (status == HDR_BADSUM) {
+        /* chksum failed: abort */
+        exit(150);
+    } else if (status == HDR_BADVERSION) {
+        exit(101);
+    } else if (status != HDR_OK) {
+        exit(100);
+    }
+    return 1;
+}
+
+/* the workers may still be writing from the mapping,
+ * so wait for them before closing the archive */
+static void finish_extract(reader *rd) {
+    if (nworkers > 1) {
+        stop_workers();
+    }
+    if (ring != NULL) {
+        stop_ring();
+    }
+    close_reader(rd);
+}
+
+/* extract files from the archive */
+int extract_archive(char *tar_file, char **paths,
+                    int supplied_path, int path_count) {
+    int fd;
+    reader rd;
+    member m;
+    tar_index idx;
+    idx_entry **hits;
+    int nhits;
+    int j;
+    int match;
+    int got;
+
+    /* open the tar file for reading, - is standard input */
+    if (strcmp(tar_file, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(tar_file, O_RDONLY)) == -1) {
+        perror(tar_file);
+        exit(25);
+    }
+    open_reader(&rd, fd, MADV_SEQUENTIAL);
+    if (jobs > 1) {
+        start_workers(jobs);
+    } else {
+        start_ring();
+    }
+
+    /* with an up to date index go straight to the targeted members */
+    if (supplied_path && load_index(tar_file, fd, &idx)) {
+        nhits = index_lookup(&idx, paths, path_count, &hits);
+        for (j = 0; j < nhits; j++) {
+            seek_reader(&rd, hits[j]->offset);
+            if ((got = next_member(&rd, &m)) == 0) {
+                break;
+            }
+            if (got == 1) {
+                extract_member(&rd, &m);
+            }
+        }
+        free(hits);
+        free_index(&idx);
+        finish_extract(&rd);
+        return 1;
+    }
+
+    /* one header block at a time, straight from the mapping
+     * or read into the packed struct */
+    while ((got = next_member(&rd, &m)) != 0) {
+        if (got == 2) {
+            continue;
+        }
+        /* check if a specific path was supplied on the command line */
+        match = !supplied_path;
+        for (j = 0; j < path_count && !match; j++) {
+            match = path_matches(m.path, paths[j]);
+        }
+
+        /* this chunk of the tape was not
+         * targeted by the command line input, skip past it */
+        if (!match) {
+            skip_data(&rd, padded_size(m.size));
+            continue;
+        }
+        extract_member(&rd, &m);
+    }
+    finish_extract(&rd);
+    return 1;
+}
+
+/*print one line of the listing for m*/
+static void print_member(member *m){
+    char perms[PERMS_SIZE+1] = "-rwxrwxrwx";
+    struct tm *time;
+    time_t mtime;
+    /*put mtime formatted as a string into this var*/
+    char pbuff[TIME_SIZE+1];
+
+    /*do this stuff if we are in verbose mode*/
+    if(v_flag){
+        /*check file type*/
+        if(m->typeflag == '5' || m->typeflag == 'D'){
+            perms[0] = 'd';
+        } else if(m->typeflag == '2'){
+            perms[0] = 'l';
+        } else if(m->typeflag == '1'){
+            perms[0] = 'h';
+        }
+
+        /*check mode bits*/
+        if(  !(m->mode & S_IRUSR)){
+            perms[1] = '-';
+        }
+        if(  !(m->mode & S_IWUSR)){
+            perms[2] = '-';
+        }
+        if(  !(m->mode & S_IXUSR)){
+            perms[3] = '-';
+        }
+        if(  !(m->mode & S_IRGRP)){
+            perms[4] = '-';
+        }
+        if(  !(m->mode & S_IWGRP)){
+            perms[5] = '-';
+        }
+        if(  !(m->mode & S_IXGRP)){
+            perms[6] = '-';
+        }
+        if(  !(m->mode & S_IROTH)){
+            perms[7] = '-';
+        }
+        if(  !(m->mode & S_IWOTH)){
+            perms[8] = '-';
+        }
+        if(  !(m->mode & S_IXOTH)){
+            perms[9] = '-';
+        }
+
+        printf("%s ", perms);
+        strcpy(perms, "-rwxrwxrwx");
+
+        /*uname/gname*/
+        /*if uname or gname not there, use uid & gid*/
+        if(m->uname[0] == '\0'){
+            printf("%ld/", (long)m->uid);
+        }else{
+            printf("%s/", m->uname);
+        }
+        if(m->gname[0] == '\0'){
+            printf("%ld ", (long)m->gid);
+        }else{
+            printf("%s ", m->gname);
+        }
+
+        /*printf the size, a sparse file's real one*/
+        printf("%8ld ", (long)m->realsize);
+
+        /*print the mtime in the format specified*/
+        mtime = (time_t)m->mtime;
+        if((time = localtime(&mtime)) == NULL){
+            perror("localtime");
+            exit(EXIT_FAILURE);
+        }
+        strftime(pbuff, TIME_SIZE+1, "%Y-%m-%d %H:%M", time);
+        printf("%s ", pbuff);
+    }
+
+    /*print the file name*/
+    printf("%s\n", m->path);
+}
+
+/*decode the header at rd into m, exiting if it's bad.
+ * returns 1 for a member and 0 at the end of the archive*/
+static int list_next(reader *rd, member *m){
+    /*checks the chksum, magic, and in strict mode the
+ * version and octal strings, then splits out every field.
+ * an archive without end blocks just stops*/
+    int i = read_header(rd, m);
+
+    if(i == HDR_END){
+        return 0;
+    } else if(i != HDR_OK && i != HDR_SKIP){
+        exit(EXIT_FAILURE);
+    }
+    return 1;
+}
+
+int print_archive(char *tarfile, char **files, int numFiles) {
+    int fd;
+    reader rd;
+    member m;
+    tar_index idx;
+    idx_entry **hits;
+    int nhits;
+    int j = 0, ahead = 0;
+
+
+    if(strcmp(tarfile, "-") == 0){
+        fd = STDIN_FILENO;
+    } else if((fd = open(tarfile, O_RDONLY)) == -1){
+        perror("open: tarfile");
+        exit(EXIT_FAILURE);
+    }
+    /*we only ever look at headers so tell the
+ * kernel not to read ahead into the file data*/
+    open_reader(&rd, fd, MADV_RANDOM);
+
+    /*if there's an up to date index only visit the
+ * headers of the requested files, or all of them, and
+ * since it says where they all are keep reads going
+ * for the next few while each one is printed. without
+ * it the next header is only known from this one*/
+    if(load_index(tarfile, fd, &idx)){
+        if(numFiles != 0){
+            nhits = index_lookup(&idx, files, numFiles, &hits);
+        } else{
+            nhits = index_all(&idx, &hits);
+        }
+        for(j = 0; j<nhits; j++){
+            for(; ahead<nhits && ahead<j+LIST_AHEAD; ahead++){
+                prefetch_header(&rd, hits[ahead]->offset);
+            }
+            seek_reader(&rd, hits[j]->offset);
+            if(!list_next(&rd, &m)){
+                break;
+            }
+            print_member(&m);
+        }
+        free(hits);
+        free_index(&idx);
+        close_reader(&rd);
+        return 1;
+    }
+
+    while(list_next(&rd, &m)){
+        /*go past the data to the block with the next header*/
+        skip_data(&rd, padded_size(m.size));
+
+/*check filenames if they are given*/
+        if(numFiles !=0){
+            for(j = 0; j<numFiles; j++){
+                if(path_matches(m.path, files[j])){
+                    break;
+                }
+            }
+
+            /*if we header name wasn't any requested
+ * file name or member of a requested directory
+ * go to next header*/
+            if(j == numFiles){
+                continue;
+            }
+        }
+
+        print_member(&m);
+    }
+
+    close_reader(&rd);
+    return 1;
+}
+
+/*put path into the name fields of head, cut up into prefix
+ * and name if it's longer than 100. returns -1 if it doesn't fit*/
+static int putName(header *head, const char *path){
+    int i = 0, fnameLength = strlen(path);
+
+    memset(head->name, 0, NAME_SIZE);
+    memset(head->prefix, 0, PREFIX_SIZE);
+
+    /*if the filename is bigger
+ * than 256 then we can't do anything*/
+    if(fnameLength > PREFIX_SIZE+NAME_SIZE+1){
+        return -1;
+    /*cut up a name into prefix and name fields*/
+    } else if(fnameLength > 100){
+        /*look for a '/' to break up the file name*/
+        i = fnameLength - NAME_SIZE-1;
+        while(i<fnameLength){
+            /*if I can't break up the file
+ * name then we can't do anything*/
+            if( (i > PREFIX_SIZE) || (i==fnameLength)){
+                return -1;
+            }
+            /*break up the prefix and name if we found a '/'*/
+            if(path[i] == '/'){
+                memcpy(head->prefix, path, i);
+                strncpy(head->name, path+i+1, NAME_SIZE);
+                return 0;
+            }
+            i++;
+        }
+        /*no '/' to break it at, the last part is too long*/
+        return -1;
+    /*only put in the name if it is 100 or less than characters*/
+    } else{
+        strncpy(head->name, path, NAME_SIZE);
+    }
+    return 0;
+}
+
+/*add "length key=value\n" to buf, the length counting its own
+ * digits. returns how long the record is*/
+static size_t paxRecord(char *buf, const char *key, const char *value){
+    size_t len = strlen(key)+strlen(value)+3, digits = 1, p;
+
+    /*one more digit each time the total reaches the next power of ten*/
+    for(p = 10; len+digits >= p; p *= 10){
+        digits++;
+    }
+    sprintf(buf, "%lu %s=%s\n", (unsigned long)(len+digits), key, value);
+    return len+digits;
+}
+
+/*put val in an octal field, or if it doesn't fit a record for key
+ * in buf and, unless strict, base-256 in the field for tars that
+ * don't read extended headers. returns how long the record is*/
+static size_t putNumber(char *field, int size, int64_t val,
+ const char *key, char *buf){
+    char num[24];
+
+    if(val >= 0 && val >> (3*(size-1)) == 0){
+        put_field(field, size, val);
+        return 0;
+    }
+    memset(field, 0, size);
+    if(!S_flag){
+        insert_special_int(field, size, val);
+    }
+    sprintf(num, "%ld", (long)val);
+    return paxRecord(buf, key, num);
+}
+
+/*an mtime record with the fraction of a second, a time before the
+ * epoch counting back from it, -1.25 for a second and a quarter*/
+static size_t paxTime(char *buf, time_t sec, long nsec){
+    char num[48];
+
+    if(sec < 0 && nsec > 0){
+        sprintf(num, "-%ld.%09ld", (long)-(sec+1), 1000000000-nsec);
+    } else{
+        sprintf(num, "%ld.%09ld", (long)sec, nsec);
+    }
+    return paxRecord(buf, "mtime", num);
+}
+
+/*fill in e->head from e->st, and e->pax with records for whatever's
+ * too long or too big for it*/
+static void makeHeader(entry *e){
+    header *head = &e->head;
+    struct passwd pwd, *pass;
+    struct group grp, *gr;
+    char names[NAME_BUF_SIZE], target[PATH_MAX];
+    /*lstat took the path so it's under PATH_MAX, and main
+ * keeps -U names under NAME_BUF_SIZE like looked up ones*/
+    char records[2*PATH_MAX+2*NAME_BUF_SIZE+256];
+    const char *uname = NULL, *gname = NULL;
+    size_t recLen = 0, timeLen;
+    ssize_t n;
+    uint32_t chksum = 0, mode = 0;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+
+    memset(head, 0, sizeof(header));
+    e->pax = NULL;
+    e->paxLen = 0;
+
+    /*a path that won't split into prefix and name goes in a
+ * record, with as much as fits in name for other tars*/
+    if(putName(head, e->path) == -1){
+        recLen += paxRecord(records+recLen, "path", e->path);
+        strncpy(head->name, e->path, NAME_SIZE);
+    }
+
+    /*get the permissions, S_ISUID, S_ISGID, and sticky bit*/
+    mode = (((uint32_t)e->st.st_mode) & (S_ISUID | S_ISGID
+ | S_ISVTX | S_IRUSR | S_IWUSR |
+ S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP
+| S_IROTH | S_IWOTH | S_IXOTH));
+    /*-u, -m and -M override what lstat said so
+ * archives of the same tree come out the same*/
+    uid = owner_uid != -1 ? (uid_t)owner_uid : e->st.st_uid;
+    gid = owner_gid != -1 ? (gid_t)owner_gid : e->st.st_gid;
+    mtime = e->st.st_mtime;
+    if(mtime_mode == 'm' || (mtime_mode == 'M' && mtime > mtime_value)){
+        mtime = mtime_value;
+    }
+
+    /*numbers too big for octal go in records, size
+ * is left to whatever writes the header*/
+    put_field(head->mode, MODE_SIZE, mode);
+    recLen += putNumber(head->uid, UID_SIZE, uid, "uid", records+recLen);
+    recLen += putNumber(head->gid, GID_SIZE, gid, "gid", records+recLen);
+    timeLen = putNumber(head->mtime, MTIME_SIZE, mtime, "mtime",
+ records+recLen);
+    /*-N stores the fraction of a second too, unless -m or
+ * -M replaced the mtime*/
+    if(subsec_mtime && mtime == e->st.st_mtime &&
+ e->st.st_mtim.tv_nsec != 0){
+        timeLen = paxTime(records+recLen, mtime, e->st.st_mtim.tv_nsec);
+    }
+    recLen += timeLen;
+    /*size is 0 if not a regular file*/
+    if(S_ISREG(e->st.st_mode)){
+        put_field(head->size, SIZE_SIZE, e->st.st_size);
+    } else{
+        put_field(head->size, SIZE_SIZE, 0);
+    }
+
+    /*put in the magic and version field*/
+    strncpy(head->magic, "ustar", MAGIC_SIZE);
+    memcpy(head->version, "00", VERSION_SIZE);
+
+    /*set typeflag*/
+    if( S_ISREG(e->st.st_mode)){
+        head->typeflag[0] = '0';
+    }else if( S_ISLNK(e->st.st_mode)){
+        head->typeflag[0] = '2';
+        if((n = readlink(e->path, target, PATH_MAX-1)) == -1){
+            perror("readlink");
+        } else{
+            target[n] = '\0';
+            strncpy(head->linkname, target, LINKNAME_SIZE);
+            if(n > LINKNAME_SIZE){
+                recLen += paxRecord(records+recLen, "linkpath", target);
+            }
+        }
+    }else if(S_ISDIR(e->st.st_mode)){
+        head->typeflag[0] = '5';
+    }
+
+    /*get the uname and gname, the _r versions
+ * because the scan workers call this too*/
+    if(owner_uname != NULL){
+        uname = owner_uname;
+    } else if(getpwuid_r(uid, &pwd, names, sizeof(names), &pass) == 0
+ && pass != NULL){
+        uname = pass->pw_name;
+    }
+    if(uname != NULL){
+        strncpy(head->uname, uname, UNAME_SIZE);
+        if(strlen(uname) >= UNAME_SIZE){
+            recLen += paxRecord(records+recLen, "uname", uname);
+        }
+    }
+    if(owner_gname != NULL){
+        gname = owner_gname;
+    } else if(getgrgid_r(gid, &grp, names, sizeof(names), &gr) == 0
+ && gr != NULL){
+        gname = gr->gr_name;
+    }
+    if(gname != NULL){
+        strncpy(head->gname, gname, GNAME_SIZE);
+        if(strlen(gname) >= GNAME_SIZE){
+            recLen += paxRecord(records+recLen, "gname", gname);
+        }
+    }
+
+/*our assignment doesnt really interact
+ * with special files so I commented this out*/
+
+/*
+    sprintf(head->devmajor, "%07o", major(e->st.st_rdev));
+    sprintf(head->devminor, "%07o", minor(e->st.st_rdev));
+*/
+
+    /*the records live as long as the directory listing
+ * this entry's children come out of*/
+    if(recLen != 0){
+        e->pax = arena_alloc(&e->mem, recLen);
+        memcpy(e->pax, records, recLen);
+        e->paxLen = recLen;
+    }
+
+    /*add up the bytes, with the chksum part as spaces*/
+    chksum = header_chksum(head);
+    sprintf(head->chksum, "%07o", chksum);
+}
+
+/*the chain of files in t whose key hashes like key*/
+static seenFile *tableFind(fileTable *t, size_t key){
+    return t->size ? t->buckets[key & (t->size-1)] : NULL;
+}
+
+/*remember e in t under key*/
+static seenFile *tableAdd(fileTable *t, size_t key, entry *e){
+    seenFile *f, **old = t->buckets, *next;
+    size_t i, oldSize = t->size;
+
+    /*keep the chains short by doubling the table when it fills*/
+    if(t->count == t->size){
+        t->size = t->size ? t->size*2 : 256;
+        if((t->buckets = calloc(t->size, sizeof(seenFile *))) == NULL){
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for(i = 0; i<oldSize; i++){
+            for(f = old[i]; f != NULL; f = next){
+                next = f->next;
+                f->next = t->buckets[f->key & (t->size-1)];
+                t->buckets[f->key & (t->size-1)] = f;
+            }
+        }
+        free(old);
+    }
+    f = arena_alloc(&t->mem, sizeof(seenFile));
+    f->key = key;
+    f->dev = e->st.st_dev;
+    f->ino = e->st.st_ino;
+    f->size = e->st.st_size;
+    f->mode = e->st.st_mode;
+    f->hashed = 0;
+    f->path = arena_alloc(&t->mem, strlen(e->path)+1);
+    strcpy(f->path, e->path);
+    f->next = t->buckets[key & (t->size-1)];
+    t->buckets[key & (t->size-1)] = f;
+    t->count++;
+    return f;
+}
+
+static void tableFree(fileTable *t){
+    free(t->buckets);
+    t->buckets = NULL;
+    t->size = t->count = 0;
+    arena_release(&t->mem);
+}
+
+static size_t linkKey(entry *e){
+    return (size_t)e->st.st_dev*31+(size_t)e->st.st_ino;
+}
+
+/*the name e's file first went into the archive under,
+ * or NULL if it hasn't gone in yet*/
+static const char *findLink(entry *e){
+    seenFile *f;
+
+    for(f = tableFind(&linkTable, linkKey(e)); f != NULL; f = f->next){
+        if(f->dev == e->st.st_dev && f->ino == e->st.st_ino){
+            return f->path;
+        }
+    }
+    return NULL;
+}
+
+/*hash the len bytes of a file, from data if it's been read
+ * already or else from path, a piece at a time so the hash
+ * doesn't depend on how it was read. returns -1 if the file
+ * can't be read or isn't len bytes any more*/
+static int hashFile(const char *path, const char *data, off_t len,
+ uint64_t *hash){
+    char *buf;
+    off_t done = 0;
+    ssize_t n = 0;
+    int fd = -1;
+
+    *hash = 0;
+    if(data == NULL){
+        if((fd = open(path, O_RDONLY)) == -1){
+            return -1;
+        }
+        buf = get_data(HASH_CHUNK);
+    }
+    while(done < len){
+        n = len-done < HASH_CHUNK ? len-done : HASH_CHUNK;
+        if(data == NULL && (n = read_full(fd, buf, n)) <= 0){
+            break;
+        }
+        *hash = hash64(data != NULL ? data+done : buf, n, *hash);
+        done += n;
+    }
+    if(data == NULL){
+        put_data(buf, HASH_CHUNK);
+        close(fd);
+    }
+    return done == len ? 0 : -1;
+}
+
+static int hashEntry(entry *e){
+    if(!e->hashed && hashFile(e->path, e->data != NULL &&
+ e->dataLen == e->st.st_size ? e->data : NULL, e->st.st_size,
+ &e->hash) == 0){
+        e->hashed = 1;
+    }
+    return e->hashed ? 0 : -1;
+}
+
+/*with -D hash a file whose size has come up in the scan
+ * before, so the hashing is spread over the workers. the
+ * first of each size is only hashed if the writer finds
+ * another file of that size*/
+static void scanHash(entry *e){
+    seenFile *f;
+
+    if(!e->keep || !S_ISREG(e->st.st_mode) || e->st.st_size == 0 ||
+ e->unchanged){
+        return;
+    }
+    pthread_mutex_lock(&scanLock);
+    for(f = tableFind(&scanSizes, e->st.st_size); f != NULL &&
+ f->size != e->st.st_size; f = f->next){
+    }
+    if(f == NULL){
+        tableAdd(&scanSizes, e->st.st_size, e);
+    }
+    pthread_mutex_unlock(&scanLock);
+    if(f != NULL){
+        hashEntry(e);
+    }
+}
+
+/*do the file at path and e have the same contents*/
+static int sameContents(const char *path, entry *e){
+    const char *data = e->data != NULL && e->dataLen == e->st.st_size ?
+ e->data : NULL;
+    char *a, *b = NULL;
+    off_t done = 0, n;
+    int fd, efd = -1;
+
+    if((fd = open(path, O_RDONLY)) == -1){
+        return 0;
+    }
+    if(data == NULL && (efd = open(e->path, O_RDONLY)) == -1){
+        close(fd);
+        return 0;
+    }
+    a = get_data(HASH_CHUNK);
+    if(efd != -1){
+        b = get_data(HASH_CHUNK);
+    }
+    while(done < e->st.st_size){
+        n = e->st.st_size-done < HASH_CHUNK ? e->st.st_size-done :
+ HASH_CHUNK;
+        if(read_full(fd, a, n) != n || (b != NULL &&
+ read_full(efd, b, n) != n) ||
+ memcmp(a, b != NULL ? b : data+done, n) != 0){
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if(efd != -1){
+        close(efd);
+        put_data(b, HASH_CHUNK);
+    }
+    put_data(a, HASH_CHUNK);
+    return done == e->st.st_size;
+}
+
+/*with -D, an earlier file in the archive with the same size,
+ * mode and contents as e, or NULL. matching hashes are checked
+ * byte for byte before anything gets linked*/
+static const char *findCopy(entry *e){
+    seenFile *f;
+
+    for(f = tableFind(&copyTable, e->st.st_size); f != NULL; f = f->next){
+        if(f->size != e->st.st_size || f->mode != e->st.st_mode){
+            continue;
+        }
+        if(hashEntry(e) == -1){
+            return NULL;
+        }
+        if(!f->hashed){
+            if(hashFile(f->path, NULL, f->size, &f->hash) == -1){
+                /*gone or changed, never match it again*/
+                f->mode = 0;
+                continue;
+            }
+            f->hashed = 1;
+        }
+        if(f->hash == e->hash && sameContents(f->path, e)){
+            return f->path;
+        }
+    }
+    return NULL;
+}
+
+/*read the snapshot in file into s. a missing snapshot is an
+ * empty one, so the first run archives everything*/
+static void loadSnapshot(const char *file, snapshot *s){
+    snapHeader sh;
+    snapRecord rec;
+    struct stat st;
+    size_t pos;
+    int fd, i;
+
+    memset(s, 0, sizeof(snapshot));
+    if((fd = open(file, O_RDONLY)) == -1){
+        if(errno != ENOENT){
+            perror(file);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if(fstat(fd, &st) == -1 || (s->data = malloc(st.st_size+1)) == NULL ||
+ read_full(fd, s->data, st.st_size) != st.st_size){
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if(st.st_size < (off_t)sizeof(sh)){
+        i = -1;
+    } else{
+        memcpy(&sh, s->data, sizeof(sh));
+        i = memcmp(sh.magic, SNAP_MAGIC, SNAP_MAGIC_SIZE) != 0 ||
+ sh.version != SNAP_VERSION ? -1 : 0;
+    }
+    if(i == 0 && (s->entries = malloc((sh.count+1)*sizeof(snapEntry)))
+ == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /*paths are left in the loaded data rather than copied*/
+    pos = sizeof(sh);
+    for(; i == 0 && s->count < (int)sh.count; s->count++){
+        if(st.st_size-pos < sizeof(rec)){
+            i = -1;
+            break;
+        }
+        memcpy(&rec, s->data+pos, sizeof(rec));
+        pos += sizeof(rec);
+        if(rec.pathlen == 0 || st.st_size-pos < rec.pathlen ||
+ s->data[pos+rec.pathlen-1] != '\0'){
+            i = -1;
+            break;
+        }
+        s->entries[s->count].rec = rec;
+        s->entries[s->count].path = s->data+pos;
+        pos += rec.pathlen;
+    }
+    if(i == -1){
+        fprintf(stderr, "%s: not a snapshot\n", file);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*the first entry in s at or after path*/
+static int snapLowerBound(snapshot *s, const char *path){
+    int lo = 0, hi = s->count, mid;
+
+    while(lo < hi){
+        mid = lo+(hi-lo)/2;
+        if(strcmp(s->entries[mid].path, path) < 0){
+            lo = mid+1;
+        } else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*is e just as the last snapshot saw it. a change to the
+ * contents moves the mtime, and a change to anything in the
+ * header moves the ctime. for u, is it the same type, mtime
+ * and size as the last member with its path*/
+static int isUnchanged(entry *e){
+    int i = snapLowerBound(&oldSnap, e->path);
+    snapRecord *r;
+
+    if(i == oldSnap.count || strcmp(oldSnap.entries[i].path, e->path)){
+        return 0;
+    }
+    if(update_mode){
+        while(i+1 < oldSnap.count &&
+ !strcmp(oldSnap.entries[i+1].path, e->path)){
+            i++;
+        }
+        r = &oldSnap.entries[i].rec;
+        return (r->mode & S_IFMT) == (e->st.st_mode & S_IFMT) &&
+ r->mtime == parse_field(e->head.mtime, MTIME_SIZE) &&
+ (!S_ISREG(e->st.st_mode) || r->size == (int64_t)e->st.st_size);
+    }
+    r = &oldSnap.entries[i].rec;
+    return r->dev == (uint64_t)e->st.st_dev &&
+ r->ino == (uint64_t)e->st.st_ino &&
+ r->mode == (uint32_t)e->st.st_mode &&
+ r->size == (int64_t)e->st.st_size &&
+ r->mtime == (int64_t)e->st.st_mtim.tv_sec &&
+ r->mtimeNsec == (int64_t)e->st.st_mtim.tv_nsec &&
+ r->ctime == (int64_t)e->st.st_ctim.tv_sec &&
+ r->ctimeNsec == (int64_t)e->st.st_ctim.tv_nsec;
+}
+
+/*put e in the snapshot being built. a file that was missed, that
+ * couldn't be opened, still goes in so an unchanged directory lists
+ * it next time, but never looks unchanged so it's taken again*/
+static void snapAdd(snapshot *s, entry *e, int missed){
+    snapEntry *n;
+
+    if(s->count == s->room){
+        s->room = s->room ? s->room*2 : 256;
+        if((s->entries = realloc(s->entries, s->room*sizeof(snapEntry)))
+ == NULL){
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    n = &s->entries[s->count++];
+    n->rec.dev = e->st.st_dev;
+    n->rec.ino = e->st.st_ino;
+    n->rec.mode = e->st.st_mode;
+    n->rec.size = e->st.st_size;
+    n->rec.mtime = e->st.st_mtim.tv_sec;
+    n->rec.mtimeNsec = e->st.st_mtim.tv_nsec;
+    n->rec.ctime = e->st.st_ctim.tv_sec;
+    n->rec.ctimeNsec = missed ? -1 : e->st.st_ctim.tv_nsec;
+    n->rec.pathlen = strlen(e->path)+1;
+    n->path = arena_alloc(&s->mem, n->rec.pathlen);
+    memcpy(n->path, e->path, n->rec.pathlen);
+}
+
+/*by path, and for u by where they are in the archive*/
+static int compareSnap(const void *a, const void *b){
+    const snapEntry *x = a, *y = b;
+    int cmp = strcmp(x->path, y->path);
+
+    if(cmp != 0){
+        return cmp;
+    }
+    return (x->rec.ino > y->rec.ino)-(x->rec.ino < y->rec.ino);
+}
+
+/*for u, put a member already in the archive in oldSnap. its
+ * place in the archive goes in ino so the last of a path sorts
+ * last. links are given a size no file has, so whatever they
+ * name always goes in again*/
+static void snapMember(member *m){
+    snapshot *s = &oldSnap;
+    snapEntry *n;
+
+    if(s->count == s->room){
+        s->room = s->room ? s->room*2 : 256;
+        if((s->entries = realloc(s->entries, s->room*sizeof(snapEntry)))
+ == NULL){
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    n = &s->entries[s->count];
+    memset(&n->rec, 0, sizeof(snapRecord));
+    n->rec.ino = s->count++;
+    n->rec.mode = m->typeflag == '5' || m->typeflag == 'D' ? S_IFDIR :
+ m->typeflag == '2' ? S_IFLNK : S_IFREG;
+    n->rec.size = m->typeflag == '1' ? -1 : m->realsize;
+    n->rec.mtime = m->mtime;
+    n->rec.pathlen = strlen(m->path)+1;
+    n->path = arena_alloc(&s->mem, n->rec.pathlen);
+    memcpy(n->path, m->path, n->rec.pathlen);
+}
+
+/*write s out to file sorted by path, through a temporary
+ * renamed over the old snapshot so it's never half written*/
+static void saveSnapshot(const char *file, snapshot *s){
+    snapHeader sh;
+    char *tmp;
+    FILE *out;
+    int i;
+
+    qsort(s->entries, s->count, sizeof(snapEntry), compareSnap);
+    memset(&sh, 0, sizeof(sh));
+    memcpy(sh.magic, SNAP_MAGIC, SNAP_MAGIC_SIZE);
+    sh.version = SNAP_VERSION;
+    sh.count = s->count;
+
+    if((tmp = malloc(strlen(file)+5)) == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmp, "%s.tmp", file);
+    if((out = fopen(tmp, "wb")) == NULL){
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&sh, sizeof(sh), 1, out);
+    for(i = 0; i<s->count; i++){
+        fwrite(&s->entries[i].rec, sizeof(snapRecord), 1, out);
+        fwrite(s->entries[i].path, s->entries[i].rec.pathlen, 1, out);
+    }
+    if(fclose(out) == EOF || rename(tmp, file) == -1){
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    free(tmp);
+}
+
+static void freeSnapshot(snapshot *s){
+    free(s->entries);
+    free(s->data);
+    arena_release(&s->mem);
+    memset(s, 0, sizeof(snapshot));
+}
+
+/*set up e to be scanned for path, leaving
+ * room to put a '/' on the end of directories.
+ * the path comes from mem, or the heap if it's NULL*/
+static void newEntry(entry *e, arena *mem, const char *dir,
+ const char *name){
+    size_t len = strlen(dir)+strlen(name)+2;
+
+    memset(e, 0, sizeof(entry));
+    if(mem != NULL){
+        e->path = arena_alloc(mem, len);
+    } else if((e->path = malloc(len)) == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(e->path, "%s%s", dir, name);
+}
+
+static int compareNames(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*a name read from a directory, kept
+ * in a list until they're all counted*/
+typedef struct dirName{
+    struct dirName *next;
+    char name[1];
+} dirName;
+
+/*make e's children from the count names at head*/
+static void addChildren(entry *e, dirName *head, int count){
+    dirName *n;
+    char **sorted;
+    int i;
+
+    sorted = arena_alloc(&e->mem, count*sizeof(char *));
+    e->children = arena_alloc(&e->mem, count*sizeof(entry));
+    for(i = 0, n = head; i<count; i++, n = n->next){
+        sorted[i] = n->name;
+    }
+    if(sort_names){
+        qsort(sorted, count, sizeof(char *), compareNames);
+    }
+    for(i = 0; i<count; i++){
+        newEntry(&e->children[i], &e->mem, e->path, sorted[i]);
+    }
+    e->numChildren = count;
+}
+
+/*an unchanged directory has the same names in it as last
+ * time, so with -g they come from the snapshot instead of
+ * reading the directory. returns 0 if they didn't*/
+static int listSnapDir(entry *e){
+    dirName *head = NULL, **tail = &head, *n;
+    size_t dirLen = strlen(e->path), len;
+    const char *name, *slash;
+    int count = 0, i;
+
+    if(!e->unchanged || e->path[dirLen-1] != '/'){
+        return 0;
+    }
+    for(i = snapLowerBound(&oldSnap, e->path); i<oldSnap.count &&
+ !strncmp(oldSnap.entries[i].path, e->path, dirLen); i++){
+        /*only the names right in e, not further down*/
+        name = oldSnap.entries[i].path+dirLen;
+        len = strlen(name);
+        slash = strchr(name, '/');
+        if(len == 0 || (slash != NULL && slash != name+len-1)){
+            continue;
+        }
+        if(slash != NULL){
+            len--;
+        }
+        n = arena_alloc(&e->mem, sizeof(dirName)+len);
+        memcpy(n->name, name, len);
+        n->name[len] = '\0';
+        n->next = NULL;
+        *tail = n;
+        tail = &n->next;
+        count++;
+    }
+    if(count != 0){
+        addChildren(e, head, count);
+    }
+    return 1;
+}
+
+/*read the names in directory e into its children, in readdir order
+ * or sorted by name with -R. each name goes in a list node from e's
+ * arena, and addChildren sorts an array of pointers to them, so no
+ * name is copied or malloc'd on its own*/
+static void listDir(entry *e){
+    DIR *dir;
+    struct dirent *df;
+    dirName *head = NULL, **tail = &head, *n;
+    size_t len;
+    int count = 0;
+
+    if(snapshot_file != NULL && listSnapDir(e)){
+        return;
+    }
+    dir = opendir(e->path);
+    if(dir == NULL){
+        perror("opendir");
+        return;
+    }
+    /*everything for the children comes out of the directory's
+ * own arena, handed back in one go once it's been archived*/
+    while( (df = readdir(dir))){
+        /*'.' and '..' aren't always the first two entries*/
+        if(!strcmp(df->d_name, ".") || !strcmp(df->d_name, "..")){
+            continue;
+        }
+        len = strlen(df->d_name);
+        n = arena_alloc(&e->mem, sizeof(dirName)+len);
+        memcpy(n->name, df->d_name, len+1);
+        n->next = NULL;
+        *tail = n;
+        tail = &n->next;
+        count++;
+    }
+    closedir(dir);
+    if(count == 0){
+        return;
+    }
+    addChildren(e, head, count);
+}
+
+/*everything about e that doesn't touch the archive: lstat it, build
+ * its header, list it if it's a directory and, when there are scan
+ * workers, read a small file's contents ahead of the writer*/
+static void scanEntry(entry *e){
+    int fd;
+    ssize_t got;
+    size_t len;
+
+    if(lstat(e->path, &e->st) == -1){
+        perror("lstat");
+        return;
+    }
+
+    /*add a '/' to the end of a directory name*/
+    len = strlen(e->path);
+    if(S_ISDIR(e->st.st_mode) && e->path[len-1] != '/'){
+        strcat(e->path, "/");
+    }
+
+    makeHeader(e);
+    e->keep = 1;
+    if(snapshot_file != NULL || update_mode){
+        e->unchanged = isUnchanged(e);
+    }
+    if(S_ISDIR(e->st.st_mode)){
+        listDir(e);
+    }
+
+    /*an unchanged file won't be written, don't read it*/
+    if(!e->keep || !S_ISREG(e->st.st_mode) || scanners == 0 ||
+ e->st.st_size > (off_t)copy_bufsize || e->unchanged){
+        return;
+    }
+    /*only hold so much file data at once*/
+    pthread_mutex_lock(&scanLock);
+    if(prefetched + e->st.st_size > PREFETCH_BUDGET){
+        pthread_mutex_unlock(&scanLock);
+        return;
+    }
+    prefetched += e->st.st_size;
+    pthread_mutex_unlock(&scanLock);
+
+    e->data = get_data(e->st.st_size+1);
+    /*cant open?, skip and go to next file*/
+    if((fd = open(e->path, O_RDONLY)) == -1){
+        perror("open failed... skipping");
+        e->keep = 0;
+        return;
+    }
+    if((got = read_full(fd, e->data, e->st.st_size)) == -1){
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    e->dataLen = got;
+    close(fd);
+}
+
+/*hand entries to the scan workers, scanLock must be held*/
+static void queueEntries(entry *list, int count){
+    int i;
+
+    for(i = 0; i<count; i++){
+        list[i].next = NULL;
+        if(scanTail == NULL){
+            scanHead = &list[i];
+        } else{
+            scanTail->next = &list[i];
+        }
+        scanTail = &list[i];
+    }
+    inFlight += count;
+    pthread_cond_broadcast(&scanWork);
+}
+
+static void *scanWorker(void *arg){
+    entry *e;
+
+    (void)arg;
+    for(;;){
+        pthread_mutex_lock(&scanLock);
+        while(scanHead == NULL && !scanStop){
+            pthread_cond_wait(&scanWork, &scanLock);
+        }
+        if((e = scanHead) == NULL){
+            pthread_mutex_unlock(&scanLock);
+            return NULL;
+        }
+        scanHead = e->next;
+        if(scanHead == NULL){
+            scanTail = NULL;
+        }
+        pthread_mutex_unlock(&scanLock);
+
+        scanEntry(e);
+        if(dedup){
+            scanHash(e);
+        }
+
+        pthread_mutex_lock(&scanLock);
+        /*look ahead into subdirectories while
+ * there isn't too much waiting on the writer*/
+        if(e->numChildren != 0 && inFlight < SCAN_LOOKAHEAD){
+            e->queued = 1;
+            queueEntries(e->children, e->numChildren);
+        }
+        e->ready = 1;
+        pthread_cond_broadcast(&scanDone);
+        pthread_mutex_unlock(&scanLock);
+    }
+}
+
+/*scan e if it hasn't been, and queue a read of
+ * its data if it's small and the ring has room*/
+static void readAhead(entry *e){
+    uring_file *f = NULL;
+    int i;
+
+    if(!e->ready){
+        scanEntry(e);
+        e->ready = 1;
+    }
+    if(!e->keep || !S_ISREG(e->st.st_mode) || e->data != NULL ||
+ e->st.st_size > (off_t)copy_bufsize || e->unchanged ||
+ !uring_room(readRing)){
+        return;
+    }
+    for(i = 0; f == NULL; i++){
+        if(readFiles[i].user == NULL){
+            f = &readFiles[i];
+        }
+    }
+    e->data = get_data(e->st.st_size+1);
+    pthread_mutex_lock(&scanLock);
+    prefetched += e->st.st_size;
+    pthread_mutex_unlock(&scanLock);
+
+    f->path = e->path;
+    f->flags = O_RDONLY;
+    f->mode = 0;
+    f->write = 0;
+    f->buf = e->data;
+    f->len = e->st.st_size;
+    f->user = e;
+    uring_submit(readRing, f);
+    e->reading = 1;
+}
+
+/*the ring is done with one of its reads. if it
+ * failed tapeFile opens the file itself and says why*/
+static void readDone(uring_file *f){
+    entry *e = f->user;
+
+    if(f->open_res < 0 || f->rw_res < 0){
+        put_data(e->data, e->st.st_size+1);
+        e->data = NULL;
+        pthread_mutex_lock(&scanLock);
+        prefetched -= e->st.st_size;
+        pthread_mutex_unlock(&scanLock);
+    } else{
+        e->dataLen = f->rw_res;
+    }
+    e->reading = 0;
+    f->user = NULL;
+}
+
+/*the runs of data in the file open on fd, or NULL if it has
+ * no holes or the filesystem can't say where they are. a hole
+ * at the end gets a last run of nothing at the file's size*/
+static sparse_run *sparseMap(int fd, off_t size, int *count){
+    static sparse_run *runs = NULL;
+    static int room = 0;
+    off_t data = 0, hole;
+    int n = 0;
+
+    while(data < size){
+        if((data = lseek(fd, data, SEEK_DATA)) == -1){
+            /*nothing but hole from here to the end*/
+            if(errno != ENXIO){
+                return NULL;
+            }
+            data = size;
+        }
+        if(data >= size){
+            break;
+        }
+        if((hole = lseek(fd, data, SEEK_HOLE)) == -1){
+            return NULL;
+        }
+        if(hole > size){
+            hole = size;
+        }
+        if(n == room){
+            room = room ? room*2 : 64;
+            if((runs = realloc(runs, room*sizeof(sparse_run))) == NULL){
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        runs[n].offset = data;
+        runs[n].size = hole-data;
+        n++;
+        data = hole;
+    }
+
+    /*one run of the whole file isn't sparse at all*/
+    if(n == 1 && runs[0].offset == 0 && runs[0].size == size){
+        return NULL;
+    }
+    if(n == 0 || runs[n-1].offset+runs[n-1].size < size){
+        if(n == room){
+            room = room ? room*2 : 64;
+            if((runs = realloc(runs, room*sizeof(sparse_run))) == NULL){
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        runs[n].offset = size;
+        runs[n].size = 0;
+        n++;
+    }
+    *count = n;
+    return runs;
+}
+
+/*path with sub put in front of its last part,
+ * "dir/file" becomes "dir/sub/file"*/
+static void subName(char *buf, const char *path, const char *sub){
+    const char *base = strrchr(path, '/');
+
+    if(base == NULL){
+        sprintf(buf, "%s/%s", sub, path);
+    } else{
+        sprintf(buf, "%.*s/%s%s", (int)(base-path), path, sub, base);
+    }
+}
+
+/*name head after path with sub put in, as much of it as
+ * fits in name if it won't split into prefix and name*/
+static void standInName(header *head, const char *path, const char *sub){
+    char name[PATH_MAX+32];
+
+    subName(name, path, sub);
+    if(putName(head, name) == -1){
+        strncpy(head->name, name, NAME_SIZE);
+    }
+}
+
+/*start writing the archive to fd, which is at start. with
+ * -O the block that start falls in is read back, so every
+ * write begins at an aligned offset*/
+static void outStart(int fd, off_t start){
+    off_t base = start-start%DIRECT_ALIGN;
+    struct stat st;
+    int flags;
+
+    /*O_DIRECT on a pipe means something else entirely*/
+    if(direct_io && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))){
+        direct_io = 0;
+    }
+
+    out.size = record_size;
+    if(direct_io){
+        out.size = (out.size+DIRECT_ALIGN-1)/DIRECT_ALIGN*DIRECT_ALIGN;
+    }
+    if(posix_memalign((void **)&out.buf, DIRECT_ALIGN, out.size) != 0){
+        fprintf(stderr, "posix_memalign failed\n");
+        exit(EXIT_FAILURE);
+    }
+    out.fd = fd;
+    out.used = 0;
+    if(direct_io && base != start){
+        if(pread(fd, out.buf, start-base, base) != start-base ||
+ lseek(fd, base, SEEK_SET) == -1){
+            perror("read: tar");
+            exit(EXIT_FAILURE);
+        }
+        out.used = start-base;
+    }
+    if(direct_io && ((flags = fcntl(fd, F_GETFL)) == -1 ||
+ fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)){
+        fprintf(stderr, "no O_DIRECT here, writing through the cache\n");
+        direct_io = 0;
+    }
+}
+
+/*write out everything that's buffered*/
+static void outFlush(void){
+    if(out.used > 0 && write_all(out.fd, out.buf, out.used) == -1){
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    out.used = 0;
+}
+
+static void outWrite(const void *buf, size_t len){
+    const char *p = buf;
+    size_t n;
+
+    while(len > 0){
+        if(out.used == out.size){
+            outFlush();
+        }
+        n = out.size-out.used;
+        if(n > len){
+            n = len;
+        }
+        memcpy(out.buf+out.used, p, n);
+        out.used += n;
+        p += n;
+        len -= n;
+    }
+}
 
-            /*printf the size*/
-            octalstr = strtol(rbuff+SIZE_OFFSET, &endptr, 8);
-            printf("%8ld ", octalstr);
+static void outZeros(off_t len){
+    size_t n;
 
-            /*print the mtime in the format specified*/
-            octalstr = strtol(rbuff+MTIME_OFFSET, &endptr, 8);
-            if((time = localtime(&octalstr)) == NULL){
-                perror("localtime");
-                exit(EXIT_FAILURE);
-            }
-            strftime(pbuff, TIME_SIZE+1, "%Y-%m-%d %H:%M", time);
-            printf("%s ", pbuff);
+    while(len > 0){
+        if(out.used == out.size){
+            outFlush();
+        }
+        n = out.size-out.used;
+        if((off_t)n > len){
+            n = len;
         }
+        memset(out.buf+out.used, 0, n);
+        out.used += n;
+        len -= n;
+    }
+}
 
-        /*print the file name*/
-        printf("%s\n", fname);
-        free(fname);
+/*write a block aligned piece of the archive and pad it out*/
+static void outPadded(const void *buf, size_t len){
+    outWrite(buf, len);
+    if(len%BLOCK_SIZE != 0){
+        outZeros(BLOCK_SIZE-len%BLOCK_SIZE);
+    }
+}
 
-        /*change the block index to go
- * to the block with the next header*/
-        blckIndex += 1;
-        octalstr = strtol(rbuff+SIZE_OFFSET, &endptr, 8);
-        blckIndex += octalstr/BLOCK_SIZE;
-        if( (octalstr%BLOCK_SIZE) != 0){
-            blckIndex += 1;
+/*copy up to len bytes of in into the archive, returning how
+ * many there were. when writes needn't be whole records a big
+ * file goes past the buffer and the kernel copies it, anything
+ * else is read straight into the buffer*/
+static off_t outCopy(int in, off_t len){
+    off_t done = 0;
+    ssize_t n;
+    size_t want;
+
+    if(!whole_records && !direct_io && len >= ZERO_COPY_MIN){
+        outFlush();
+        done = copy_kernel(in, out.fd, len);
+    }
+    while(done < len){
+        if(out.used == out.size){
+            outFlush();
+        }
+        want = out.size-out.used;
+        if((off_t)want > len-done){
+            want = len-done;
         }
-        if(lseek(fd, blckIndex*BLOCK_SIZE,SEEK_SET) == -1){
-            perror("lseek");
+        if((n = read_full(in, out.buf+out.used, want)) == -1){
+            perror("read");
             exit(EXIT_FAILURE);
         }
+        if(n == 0){
+            break;
+        }
+        out.used += n;
+        done += n;
     }
-
-
-    return 1;
+    return done;
 }
 
+/*write what's left. with -b the last record is padded out, and
+ * with -O whatever isn't a whole aligned block is written after
+ * turning O_DIRECT back off, so the archive ends where it should*/
+static void outFinish(void){
+    size_t whole, tail;
+    int flags;
 
+    if(whole_records && out.used > 0){
+        memset(out.buf+out.used, 0, out.size-out.used);
+        out.used = out.size;
+    }
+    if(direct_io){
+        tail = out.used%DIRECT_ALIGN;
+        whole = out.used-tail;
+        out.used = whole;
+        outFlush();
+        memmove(out.buf, out.buf+whole, tail);
+        if((flags = fcntl(out.fd, F_GETFL)) == -1 ||
+ fcntl(out.fd, F_SETFL, flags & ~O_DIRECT) == -1){
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+        out.used = tail;
+    }
+    outFlush();
+    free(out.buf);
+    out.buf = NULL;
+    out.fd = -1;
+}
 
-void tapeFile(int tarFd, char *file){
-    struct stat *lbuff = malloc(sizeof(struct stat));
-    struct group *grp;
-    struct passwd *pass;
-    char *fileDir;
-    DIR *dir;
-    struct dirent *df;
-    char *fileContents;
-    int i = 0, fnameLength = 0, fd, fd2;
-    uint32_t chksum = 0, mode = 0;
-    header *head = calloc(1, sizeof(header));
-    /*used to add up all the bytes in the header*/
-    uint8_t *altHead = (uint8_t *)head;
-
+/*write head for e with size put in it. an extended header goes
+ * first with e's records, more and a size record if size is too
+ * big for octal, when there are any. the compressor is told the
+ * member starts at the first of them*/
+static void tapeHeader(entry *e, header *head, off_t size,
+ const char *more, size_t moreLen){
+    header pax;
+    char sizeRec[64];
+    size_t sizeLen, total;
+
+    sizeLen = putNumber(head->size, SIZE_SIZE, size, "size", sizeRec);
+    sprintf(head->chksum, "%07o", header_chksum(head));
+    total = e->paxLen+moreLen+sizeLen;
+
+    if(tarFilter != NULL && filter_mark(tarFilter, tarPos) == -1){
+        exit(EXIT_FAILURE);
+    }
+    if(total != 0){
+        pax = *head;
+        standInName(&pax, e->path, "PaxHeaders");
+        pax.typeflag[0] = 'x';
+        memset(pax.linkname, 0, LINKNAME_SIZE);
+        put_field(pax.size, SIZE_SIZE, total);
+        sprintf(pax.chksum, "%07o", header_chksum(&pax));
+        outWrite(&pax, BLOCK_SIZE);
+        outWrite(e->pax, e->paxLen);
+        outWrite(more, moreLen);
+        outWrite(sizeRec, sizeLen);
+        outZeros(padded_size(total)-total);
+        tarPos += BLOCK_SIZE+padded_size(total);
+    }
+    outWrite(head, BLOCK_SIZE);
+    tarPos += BLOCK_SIZE;
+}
 
-    if(lstat(file, lbuff) == -1){
-        perror("lstat");
-        return;
+/*write e as a pax 1.0 sparse file, the way GNU tar does: an
+ * extended header with its real name and size, then a header
+ * under a made up name whose data is a map of the runs of data
+ * and the runs themselves. the holes take no room at all.
+ * returns -1, having written nothing, if e has no holes*/
+static int tapeSparse(entry *e, int fd){
+    sparse_run *runs;
+    header head;
+    char num[32], records[PATH_MAX+256];
+    char *map;
+    size_t recLen = 0, mapLen = 0;
+    off_t dataLen = 0, copied;
+    int count, i;
+
+    if((runs = sparseMap(fd, e->st.st_size, &count)) == NULL){
+        return -1;
+    }
+    for(i = 0; i<count; i++){
+        dataLen += runs[i].size;
     }
 
-    if(lbuff == NULL){
+    /*decimal lines of the count and then each offset and size*/
+    if((map = malloc((2*count+1)*21+1)) == NULL){
         perror("malloc");
         exit(EXIT_FAILURE);
     }
-    if(head == NULL){
-        perror("calloc");
-        exit(EXIT_FAILURE);
+    mapLen = sprintf(map, "%d\n", count);
+    for(i = 0; i<count; i++){
+        mapLen += sprintf(map+mapLen, "%ld\n%ld\n",
+ (long)runs[i].offset, (long)runs[i].size);
     }
 
-
-    fd = open(file, O_RDONLY);
-
-    /*cant open?, skip and go to next file*/
-    if(fd ==-1){
-        perror("open failed... skipping");
-        return;
+    /*the header after the extended one is named so that
+ * tars that don't know about sparse files extract the
+ * map and data somewhere out of the way*/
+    head = e->head;
+    standInName(&head, e->path, "GNUSparseFile.0");
+
+    recLen += paxRecord(records+recLen, "GNU.sparse.major", "1");
+    recLen += paxRecord(records+recLen, "GNU.sparse.minor", "0");
+    recLen += paxRecord(records+recLen, "GNU.sparse.name", e->path);
+    sprintf(num, "%ld", (long)e->st.st_size);
+    recLen += paxRecord(records+recLen, "GNU.sparse.realsize", num);
+
+    tapeHeader(e, &head, padded_size(mapLen)+dataLen, records, recLen);
+    outPadded(map, mapLen);
+    free(map);
+
+    /*only the runs of data are read, a file that shrank
+ * since it was mapped is zero filled like any other*/
+    for(i = 0; i<count; i++){
+        copied = 0;
+        if(lseek(fd, runs[i].offset, SEEK_SET) != -1){
+            copied = outCopy(fd, runs[i].size);
+        }
+        if(copied < runs[i].size){
+            fprintf(stderr, "%s: file shrank, zero filling\n", e->path);
+            outZeros(runs[i].size-copied);
+        }
     }
+    if(dataLen%BLOCK_SIZE != 0){
+        outZeros(BLOCK_SIZE-dataLen%BLOCK_SIZE);
+    }
+    tarPos += padded_size(mapLen)+padded_size(dataLen);
+    return 0;
+}
 
-    /*add a '/' to the end of a directory name*/
-    fnameLength = strlen(file);
-    if(S_ISDIR(lbuff->st_mode)){
-        strncat(file, "/", 2);
-        fnameLength++;
+/*write e as a link to target, just the header, and a
+ * linkpath record if target is too long for linkname*/
+static void tapeLink(entry *e, const char *target){
+    header head = e->head;
+    char record[PATH_MAX+32];
+    size_t recLen = 0;
+
+    head.typeflag[0] = '1';
+    strncpy(head.linkname, target, LINKNAME_SIZE);
+    if(strlen(target) > LINKNAME_SIZE){
+        recLen = paxRecord(record, "linkpath", target);
     }
+    tapeHeader(e, &head, 0, record, recLen);
+}
 
+static int compareDump(const void *a, const void *b){
+    return strcmp(*(char * const *)a+1, *(char * const *)b+1);
+}
 
-    /*if the filename is bigger
- * than 256 then we can't do anything*/
-    if(fnameLength > PREFIX_SIZE+NAME_SIZE+1){
-        fprintf(stderr, "path name is too long");
-        return;
-    /*cut up a name into prefix and name fields*/
-    } else if(fnameLength > 100){
-        /*look for a '/' to break up the file name*/
-        i = fnameLength - NAME_SIZE-1;
-        while(i<fnameLength){
-            /*if I can't break up the file
- * name then we can't do anything*/
-            if( (i > PREFIX_SIZE) || (i==fnameLength)){
-            fprintf(stderr, "prefix: can't be broken on a '/'");
-                return;
-            }
-            /*break up the prefix and name if we found a '/'*/
-            if(file[i] == '/'){
-                strncpy(head->prefix, file, i);
-                strncpy(head->name, file+i+1, NAME_SIZE);
-                break;
-            }
-            i++;
+/*with -g a directory goes in as a GNU dumpdir, which lists
+ * what's in it so extracting can take away whatever's gone
+ * since. each name follows Y if it's in this archive, N if
+ * it's unchanged and D if it's a directory, sorted by name,
+ * and an empty name ends the list. the children have to be
+ * scanned first*/
+static void tapeDumpDir(entry *e){
+    static char *names = NULL, *dump = NULL, **sorted = NULL;
+    static size_t room = 0, sortRoom = 0;
+    size_t len = 0, dirLen = strlen(e->path), n;
+    header head = e->head;
+    entry *c;
+    int i, count = 0;
+
+    for(i = 0; i<e->numChildren; i++){
+        if(e->children[i].st.st_mode != 0){
+            len += strlen(e->children[i].path)-dirLen+2;
         }
-    /*only put in the name if it is 100 or less than characters*/
-    } else{
-        strncpy(head->name, file, NAME_SIZE);
     }
-
-    /*get the permissions, S_ISUID, S_ISGID, and sticky bit*/
-    mode = (((uint32_t)lbuff->st_mode) & (S_ISUID | S_ISGID
- | S_ISVTX | S_IRUSR | S_IWUSR |
- S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP
-| S_IROTH | S_IWOTH | S_IXOTH));
-    snprintf(head->mode, MODE_SIZE, "%07o", mode);
- 
-    /*use the insert function if the
- * uid is too big for a 7 digit octal*/
-    if(lbuff->st_uid > 07777777){
-        /*we can't do anything if the octal is
- * too big and we are in strict*/
-        if(S_flag){
-            fprintf(stderr, "uid is too big for an octal string\n");
-            free(head);
-            /*if dir, then put in all the files*/
-            if( S_ISDIR(lbuff->st_mode)){
-                dir = opendir(file);
-                if(dir == NULL){
-                    perror("opendir");
-                    return;
-                }
-                /*no point in adding '.' and '..'
- * directories to the tar file*/
-                readdir(dir);
-                readdir(dir);
-                /*call the tapefile function for
- * every file in the directory*/
-                while( (df = readdir(dir))){
-                    fileDir =
-                    malloc((fnameLength+2+
-strlen(df->d_name))*sizeof(char));
-                    if(fileDir == NULL){
-                        perror("malloc");
-                        exit(EXIT_FAILURE);
-                    }
-                    sprintf(fileDir, "%s%s",
- file, df->d_name);
-                    tapeFile(tarFd, fileDir);
-                    free(fileDir);
-                }
-                free(dir);
-            }
-            free(lbuff);
-            close(fd);
-            return;
+    if(len+1 > room){
+        room = (len+1)*2;
+        free(names);
+        free(dump);
+        if((names = malloc(room)) == NULL || (dump = malloc(room)) == NULL){
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-        /*put in the special int if not in strict*/
-        if(S_flag != 1){
-            insert_special_int(head->uid, 8,(int32_t)lbuff->st_uid);
+    }
+    if((size_t)e->numChildren > sortRoom){
+        sortRoom = e->numChildren*2;
+        free(sorted);
+        if((sorted = malloc(sortRoom*sizeof(char *))) == NULL){
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-    /*put in uid if it is not too big*/
-    } else {
-        snprintf(head->uid, UID_SIZE, "%07o", lbuff->st_uid);
     }
 
-    /*put in the gid*/
-    snprintf(head->gid, GID_SIZE, "%07o", lbuff->st_gid);
-
-
-    /*put in file size*/
-    if(S_ISREG(lbuff->st_mode)){
-        sprintf(head->size, "%011o", (unsigned int)(lbuff->st_size));
-    } else{
-        /*size is 0 if not a regular file*/
-        sprintf(head->size, "00000000000");
+    /*the code and name of every child that lstat found,
+ * without the '/' on the end of a directory*/
+    len = 0;
+    for(i = 0; i<e->numChildren; i++){
+        c = &e->children[i];
+        if(c->st.st_mode == 0){
+            continue;
+        }
+        sorted[count++] = names+len;
+        names[len++] = S_ISDIR(c->st.st_mode) ? 'D' :
+ c->unchanged ? 'N' : 'Y';
+        strcpy(names+len, c->path+dirLen);
+        len += strlen(c->path+dirLen);
+        if(names[len-1] == '/'){
+            len--;
+        }
+        names[len++] = '\0';
     }
-    /*set the mtime*/
-    sprintf(head->mtime, "%011o", (unsigned int)(lbuff->st_mtime));
-
-    /*put in the magic and version field*/
-    strncpy(head->magic, "ustar", MAGIC_SIZE);
-    strncpy(head->version, "00", VERSION_SIZE);
-
-    /*set typeflag*/
-    if( S_ISREG(lbuff->st_mode)){
-        strncpy(head->typeflag, "0", TYPEFLAG_SIZE);
-    }else if( S_ISLNK(lbuff->st_mode)){
-        strncpy(head->typeflag, "2", 1);
-        readlink(file, head->linkname, LINKNAME_SIZE);
-    }else if(S_ISDIR(lbuff->st_mode)){
-        strncpy(head->typeflag, "5", 1);
+    qsort(sorted, count, sizeof(char *), compareDump);
+    len = 0;
+    for(i = 0; i<count; i++){
+        n = strlen(sorted[i])+1;
+        memcpy(dump+len, sorted[i], n);
+        len += n;
     }
+    dump[len++] = '\0';
 
-    /*get the uname*/
-    pass = getpwuid(lbuff->st_uid);
-    strncpy(head->uname, pass->pw_name, UNAME_SIZE);
-
-    /*get gname*/
-    grp = getgrgid(lbuff->st_gid);
-    strncpy(head->gname, grp->gr_name, GNAME_SIZE);
-
-/*our assignment doesnt really interact
- * with special files so I commented this out*/
-
-/*
-    sprintf(head->devmajor, "%07o", major(lbuff->st_rdev));
-    sprintf(head->devminor, "%07o", minor(lbuff->st_rdev));
-*/
+    head.typeflag[0] = 'D';
+    if(v_flag == 1){
+        printf("%s\n", e->path);
+    }
+    tapeHeader(e, &head, len, NULL, 0);
+    outPadded(dump, len);
+    tarPos += padded_size(len);
+}
 
-    /*index through bytes and set chksum, and set it*/
-    i=0;
-    while(i < BLOCK_SIZE){
-        /*treat the chksum part as all spaces*/
-        if(i == CHKSUM_OFFSET){
-            chksum += 32*8;
-            i = TYPEFLAG_OFFSET;
+/*write e's header and contents to the archive. returns -1
+ * if it was skipped because it couldn't be opened*/
+static int tapeFile(entry *e){
+    const char *link, *target;
+    seenFile *f;
+    off_t copied = 0;
+    int fd = -1;
+
+    /*another name for a file that's already in the
+ * archive goes in as a link to it, without the data,
+ * and with -D so does a copy of one*/
+    link = S_ISREG(e->st.st_mode) && e->st.st_nlink > 1 ?
+ findLink(e) : NULL;
+    target = link;
+    if(target == NULL && dedup && S_ISREG(e->st.st_mode) &&
+ e->st.st_size > 0){
+        target = findCopy(e);
+    }
+    if(target != NULL){
+        tapeLink(e, target);
+        if(e->st.st_nlink > 1 && link == NULL){
+            tableAdd(&linkTable, linkKey(e), e);
         }
-        chksum += (uint8_t)altHead[i++];
+        if(v_flag == 1){
+            printf("%s\n", e->path);
+        }
+        return 0;
+    }
 
+    /*cant open?, skip and go to next file*/
+    if(S_ISREG(e->st.st_mode) && e->data == NULL &&
+ (fd = open(e->path, O_RDONLY)) == -1){
+        perror("open failed... skipping");
+        return -1;
+    }
+    if(S_ISREG(e->st.st_mode) && e->st.st_nlink > 1 && link == NULL){
+        tableAdd(&linkTable, linkKey(e), e);
+    }
+    if(dedup && S_ISREG(e->st.st_mode) && e->st.st_size > 0){
+        f = tableAdd(&copyTable, e->st.st_size, e);
+        f->hashed = e->hashed;
+        f->hash = e->hash;
     }
-    sprintf(head->chksum, "%07o", chksum);
 
     /*print the file name if verbose*/
     if(v_flag == 1){
-        printf("%s\n", file);
+        printf("%s\n", e->path);
+    }
+
+    /*a file with fewer blocks than its size has holes,
+ * store just its data if it really does*/
+    if(fd != -1 && (off_t)e->st.st_blocks*512 < e->st.st_size &&
+ tapeSparse(e, fd) == 0){
+        close(fd);
+        return 0;
     }
 
     /*write the header*/
-    if(write(tarFd, head, BLOCK_SIZE) == -1){
-        perror("write");
-        exit(EXIT_FAILURE);
+    if(!S_ISREG(e->st.st_mode)){
+        tapeHeader(e, &e->head, 0, NULL, 0);
+        return 0;
+    }
+    tapeHeader(e, &e->head, e->st.st_size, NULL, 0);
+    tarPos += padded_size(e->st.st_size);
+
+    /*write the contents read ahead by a worker,
+ * or stream the file a buffer at a time*/
+    if(e->data != NULL){
+        outWrite(e->data, e->dataLen);
+        copied = e->dataLen;
+    } else{
+        copied = outCopy(fd, e->st.st_size);
+        close(fd);
+    }
+    /*the file shrank since we lstat'ed it, zero fill
+ * so the archive still matches the size in the header*/
+    if(copied < e->st.st_size){
+        fprintf(stderr, "%s: file shrank, zero filling\n", e->path);
+        outZeros(e->st.st_size - copied);
     }
 
-    /*write the file contents*/
-    if( S_ISREG(lbuff->st_mode)){
-        fileContents = malloc(lbuff->st_size);
-        if(fileContents==NULL){
-            perror("malloc");
-            exit(EXIT_FAILURE);
+    /*pad out the last block to
+ * make sure we've written a full block*/
+    if( (e->st.st_size%BLOCK_SIZE) != 0){
+        outZeros(BLOCK_SIZE-(e->st.st_size % BLOCK_SIZE));
+    }
+    return 0;
+}
+
+/*get all of e's children scanned, by the workers if
+ * there are any, so tapeDumpDir knows which changed*/
+static void scanChildren(entry *e){
+    int i;
+
+    if(scanners == 0){
+        for(i = 0; i<e->numChildren; i++){
+            if(!e->children[i].ready){
+                scanEntry(&e->children[i]);
+                e->children[i].ready = 1;
+            }
         }
-        if(fileContents == NULL){
-            perror("malloc");
-            exit(EXIT_FAILURE);
+        return;
+    }
+    pthread_mutex_lock(&scanLock);
+    if(!e->queued){
+        e->queued = 1;
+        queueEntries(e->children, e->numChildren);
+    }
+    for(i = 0; i<e->numChildren; i++){
+        while(!e->children[i].ready){
+            pthread_cond_wait(&scanDone, &scanLock);
         }
-        if((fd2 = open(file, O_RDONLY)) == -1 ){
-            fprintf(stderr, "Can't open file... skipping\n");
-            return;
+    }
+    pthread_mutex_unlock(&scanLock);
+}
+
+/*archive each entry in list, and everything under
+ * the directories, in order. workers may be scanning
+ * ahead but only this thread ever writes*/
+static void tapeTree(entry *list, int count){
+    entry *e;
+    int i, ahead = 0, missed;
+
+    for(i = 0; i<count; i++){
+        e = &list[i];
+        if(readRing != NULL){
+            /*keep reads going for the next files while
+ * this one is written, it always gets scanned*/
+            for(; ahead<count && ahead<i+RING_DEPTH &&
+ (ahead <= i || uring_room(readRing)); ahead++){
+                readAhead(&list[ahead]);
+            }
+            uring_kick(readRing);
+            while(e->reading){
+                readDone(uring_wait(readRing));
+            }
+        } else if(scanners == 0){
+            scanEntry(e);
+        } else{
+            pthread_mutex_lock(&scanLock);
+            while(!e->ready){
+                pthread_cond_wait(&scanDone, &scanLock);
+            }
+            pthread_mutex_unlock(&scanLock);
         }
-        if(read(fd2, fileContents, lbuff->st_size) == -1){
-            perror("read");
-            exit(EXIT_FAILURE);
+
+        missed = !e->keep;
+        if(e->keep && snapshot_file != NULL && S_ISDIR(e->st.st_mode)){
+            scanChildren(e);
+            tapeDumpDir(e);
+        } else if(e->keep && !e->unchanged){
+            missed = tapeFile(e) == -1;
         }
-        close(fd2);
-        if(write(tarFd, fileContents, lbuff->st_size) == -1){
-            perror("write");
-            exit(EXIT_FAILURE);
+        /*with -g everything lstat found goes in the new
+ * snapshot, but only what's changed goes in the archive.
+ * that's done after, so a file that was skipped is
+ * known to be*/
+        if(e->st.st_mode != 0 && snapshot_file != NULL){
+            snapAdd(&newSnap, e, missed);
         }
-        free(fileContents);
-    
-        /*pad out the last block to
- * make sure we've written a full block*/
-        if( (lbuff->st_size%BLOCK_SIZE) != 0){
-            fileContents = calloc(lbuff->st_size % BLOCK_SIZE,
-sizeof(uint8_t));
-            if(fileContents == NULL){
-                perror("calloc");
-                exit(EXIT_FAILURE);
-            }
-            if(write(tarFd, fileContents,
-BLOCK_SIZE-(lbuff->st_size % BLOCK_SIZE)) == -1){
-                perror("write");
-                exit(EXIT_FAILURE);
+        if(e->data != NULL){
+            put_data(e->data, e->st.st_size+1);
+            pthread_mutex_lock(&scanLock);
+            prefetched -= e->st.st_size;
+            pthread_mutex_unlock(&scanLock);
+        }
+
+        /*if dir, then put in all the files*/
+        if(e->numChildren != 0){
+            if(scanners != 0){
+                pthread_mutex_lock(&scanLock);
+                if(!e->queued){
+                    e->queued = 1;
+                    queueEntries(e->children, e->numChildren);
+                }
+                pthread_mutex_unlock(&scanLock);
             }
-            free(fileContents);
+            tapeTree(e->children, e->numChildren);
+        }
+        arena_release(&e->mem);
+
+        if(scanners != 0){
+            pthread_mutex_lock(&scanLock);
+            inFlight--;
+            pthread_mutex_unlock(&scanLock);
         }
     }
+}
+
+/*archive every given file, and everything under the
+ * directories. the trailer is left to the caller*/
+static void tapeFiles(char **files, int numFiles){
+    int i = 0;
+    entry *roots;
+    pthread_t *threads = NULL;
 
-    free(head);
+    roots = malloc((numFiles+1)*sizeof(entry));
+    if(roots == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i<numFiles; i++){
+        newEntry(&roots[i], NULL, "", files[i]);
+    }
 
+    /*with one job read ahead through io_uring, or
+ * if there isn't one fall back to a single worker*/
+    if(jobs == 1){
+        readRing = uring_open(RING_DEPTH);
+    }
 
-    /*if dir, then put in all the files*/
-    if( S_ISDIR(lbuff->st_mode)){
-        dir = opendir(file);
-        if(dir == NULL){
-            perror("opendir");
+    /*with -j, workers stat, list and read ahead
+ * while this thread writes everything in order*/
+    if(readRing == NULL){
+        threads = malloc(jobs*sizeof(pthread_t));
+        if(threads == NULL){
+            perror("malloc");
             exit(EXIT_FAILURE);
         }
-        readdir(dir);
-        readdir(dir);
-        while( (df = readdir(dir))){
-            fileDir =
-            malloc((fnameLength+2+strlen(df->d_name))*sizeof(char));
-            if(fileDir == NULL){
-                perror("malloc");
+        scanners = jobs;
+        for(i = 0; i<jobs; i++){
+            if(pthread_create(&threads[i], NULL, scanWorker, NULL) != 0){
+                fprintf(stderr, "pthread_create failed\n");
                 exit(EXIT_FAILURE);
             }
-            sprintf(fileDir, "%s%s", file, df->d_name);
-            tapeFile(tarFd, fileDir);
-            free(fileDir);
         }
-        free(dir);
+        pthread_mutex_lock(&scanLock);
+        queueEntries(roots, numFiles);
+        pthread_mutex_unlock(&scanLock);
+    }
+
+    /*put in every given file into the tarfile*/
+    tapeTree(roots, numFiles);
+
+    if(threads != NULL){
+        pthread_mutex_lock(&scanLock);
+        scanStop = 1;
+        pthread_cond_broadcast(&scanWork);
+        pthread_mutex_unlock(&scanLock);
+        for(i = 0; i<jobs; i++){
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        scanners = 0;
+    }
+    if(readRing != NULL){
+        uring_close(readRing);
+        readRing = NULL;
+    }
+    for(i = 0; i<numFiles; i++){
+        free(roots[i].path);
+    }
+    free(roots);
+    tableFree(&linkTable);
+    tableFree(&copyTable);
+    tableFree(&scanSizes);
+}
+
+/*put two 0 blocks at the end of the tarfile
+ * and write out the last record*/
+static void tapeTrailer(void){
+    outZeros(BLOCK_SIZE*2);
+    outFinish();
+}
+
+/*add files to the end of an existing archive where its
+ * trailer was, without touching what's already there. with
+ * update only files that differ from their last member go in.
+ * an index that was up to date is kept that way*/
+int append_archive(char *tarfile, char **files, int numFiles, int update){
+    int fd = open(tarfile, O_RDWR | O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO);
+    tar_index idx;
+    int haveIdx;
+    off_t end;
+
+    if(fd == -1){
+        perror("open: tar");
+        exit(EXIT_FAILURE);
+    }
+    if(out_codec != NULL || sniff_codec(fd) != NULL){
+        fprintf(stderr, "%s: can't append to a compressed archive\n",
+ tarfile);
+        exit(EXIT_FAILURE);
+    }
+    if(snapshot_file != NULL){
+        fprintf(stderr, "-g only works when creating an archive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*u has to know every member, r only where the last one ends*/
+    haveIdx = load_index(tarfile, fd, &idx);
+    update_mode = update;
+    end = archive_end(fd, haveIdx && !update ? &idx : NULL,
+ update ? snapMember : NULL);
+    if(update){
+        qsort(oldSnap.entries, oldSnap.count, sizeof(snapEntry),
+ compareSnap);
     }
 
-    free(lbuff);
+    if(lseek(fd, end, SEEK_SET) == -1){
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    tarPos = end;
+    outStart(fd, end);
+    tapeFiles(files, numFiles);
+    tapeTrailer();
     close(fd);
 
+    if(haveIdx){
+        update_index(tarfile, &idx, end);
+        free_index(&idx);
+    } else if(i_flag){
+        index_archive(tarfile);
+    }
+    freeSnapshot(&oldSnap);
+    return 1;
 }
 
 int create_archive(char *tarfile, char **files, int numFiles) {
-    /*create the tarfile if one is not
+    int fd;
+    int fileFd = -1;
+    filter flt;
+
+    /*- writes the archive to standard output, and
+ * then what -v prints goes to standard error*/
+    if(strcmp(tarfile, "-") == 0){
+        fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else{
+        /*create the tarfile if one is not
  * given, or truncate if it is not empty*/
-    int fd = open(tarfile, O_WRONLY | O_TRUNC | O_CREAT,
-      S_IRWXU | S_IRWXG | S_IRWXO);
-    int i = 0;
-    /*put two 0 blocks at the end of the tarfile*/
-    uint8_t *end = calloc(BLOCK_SIZE*2, sizeof(uint8_t));
-
+        fd = open(tarfile, O_WRONLY | O_TRUNC | O_CREAT,
+ S_IRWXU | S_IRWXG | S_IRWXO);
+    }
 
     if(fd == -1){
         perror("open: tar");
         exit(EXIT_FAILURE);
     }
 
-    if(end == NULL){
-        perror("calloc");
-        exit(EXIT_FAILURE);
+    if(snapshot_file != NULL){
+        loadSnapshot(snapshot_file, &oldSnap);
     }
 
-    /*put in every given file into the tarfile*/
-    while(i<numFiles){
-        tapeFile(fd, files[i++]);
+    /*compress on another thread while this one walks the tree.
+ * -O can't do anything for what goes down the pipe*/
+    if(out_codec != NULL){
+        direct_io = 0;
+        fileFd = fd;
+        if((fd = start_filter(&flt, out_codec, 1, fileFd, jobs)) == -1){
+            exit(EXIT_FAILURE);
+        }
+        tarFilter = &flt;
     }
 
-    /*write out the last two 0 blocks*/
-    if(write(fd, end, BLOCK_SIZE*2) == -1){
-        perror("write");
-        exit(EXIT_FAILURE);
+    outStart(fd, 0);
+    tapeFiles(files, numFiles);
+    tapeTrailer();
+
+    if(out_codec != NULL){
+        if(finish_filter(&flt) != 0){
+            exit(EXIT_FAILURE);
+        }
+        tarFilter = NULL;
+        fd = fileFd;
     }
     close(fd);
-    free(end);
 
+    /*the archive's all there, the next run can start from it*/
+    if(snapshot_file != NULL){
+        saveSnapshot(snapshot_file, &newSnap);
+        freeSnapshot(&oldSnap);
+        freeSnapshot(&newSnap);
+    }
     return 1;
 }
 
+/* parse a -B style size, allowing a k or m suffix */
+static size_t parse_size(const char *arg) {
+    char *end;
+    long val = strtol(arg, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+        val *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        val *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || val < BLOCK_SIZE) {
+        fprintf(stderr, "bad size: %s\n", arg);
+        exit(2);
+    }
+    return val;
+}
+
+/* parse a non-negative decimal number option */
+static long parse_number(const char *arg) {
+    char *end;
+    long val = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || val < 0) {
+        fprintf(stderr, "bad number: %s\n", arg);
+        exit(2);
+    }
+    return val;
+}
+
+/* split "user:group" for -U. an empty part clears that name,
+ * leaving it out means keep looking it up */
+static void split_owner(char *arg, char **user, char **group) {
+    char *colon = strchr(arg, ':');
+
+    if (colon == NULL) {
+        *user = arg;
+        return;
+    }
+    *colon = '\0';
+    *user = arg;
+    *group = colon + 1;
+}
+
+/* parse "uid:gid" for -u, either part may be left out */
+static void parse_owner(char *arg, long *uid, long *gid) {
+    char *user = NULL;
+    char *group = NULL;
+
+    split_owner(arg, &user, &group);
+    if (user != NULL && *user != '\0') {
+        *uid = parse_number(user);
+    }
+    if (group != NULL && *group != '\0') {
+        *gid = parse_number(group);
+    }
+}
+
 int main(int argc, char **argv) {
     char *tarfile;
-    char **paths = NULL;
-    int count;
-    int new_size;
+    char **paths;
     int path_count;
-    int i;
-    int supplied_path;
-    char **paths_copy;
-    char *path_substring;
-    char *new_path_piece;
+    int opt;
 
+#ifdef ALLOC_STATS
+    atexit(print_alloc_count);
+#endif
     if (argc == 1) {
-        fprintf(stderr, "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
 
     /* create an archive */
     if (strstr(argv[1], "c") != NULL) {
-        if (t_flag == 1 || x_flag == 1) {
-            fprintf(stderr,
-                    "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
-            exit(4);
-        }
         c_flag = 1;
     }
 
+    /* Append to an archive, or only what's changed with u */
+    if (strstr(argv[1], "r") != NULL || strstr(argv[1], "u") != NULL) {
+        if (c_flag == 1) {
+            fprintf(stderr, USAGE);
+            exit(5);
+        }
+        r_flag = 1;
+        u_flag = strstr(argv[1], "u") != NULL;
+    }
+
     /* Print the table of contents of an archive */
     if (strstr(argv[1], "t") != NULL) {
-        if (c_flag == 1 || x_flag == 1) {
-            fprintf(stderr,
-                    "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
+        if (c_flag == 1 || r_flag == 1) {
+            fprintf(stderr, USAGE);
             exit(5);
         }
         t_flag = 1;
@@ -1219,14 +4872,27 @@ int main(int argc, char **argv) {
 
     /* Extract the contents of an archive */
     if (strstr(argv[1], "x") != NULL) {
-        if (c_flag == 1 || t_flag == 1) {
-            fprintf(stderr,
-                    "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
+        if (c_flag == 1 || r_flag == 1 || t_flag == 1) {
+            fprintf(stderr, USAGE);
             exit(6);
         }
         x_flag = 1;
     }
 
+    /* Index the archive, after creating it when given with c */
+    if (strstr(argv[1], "i") != NULL) {
+        if (t_flag == 1 || x_flag == 1) {
+            fprintf(stderr, USAGE);
+            exit(9);
+        }
+        i_flag = 1;
+    }
+
+    /* Compress the archive with gzip */
+    if (strstr(argv[1], "z") != NULL) {
+        out_codec = find_codec("gzip");
+    }
+
     /* Increases verbosity */
     if (strstr(argv[1], "v") != NULL) {
         v_flag = 1;
@@ -1244,77 +4910,120 @@ int main(int argc, char **argv) {
 
     /* f option is required */
     if (!f_flag) {
-        fprintf(stderr,
-                "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
+        fprintf(stderr, USAGE);
         exit(3);
     }
 
     if (argc < 3) {
-        fprintf(stderr,
-                "Usage: mytar [ctx][v][S]f tarfile [ path [ ... ] ]\n");
+        fprintf(stderr, USAGE);
         exit(8);
     }
 
     tarfile = argv[2];
 
-    paths = malloc(MALLOC_SIZE);
-    if (!paths) {
-        perror("malloc");
-        exit(7);
-    }
-    count = 0;
-    new_size = MALLOC_SIZE * 2;
-    path_count = 0;
-    for (i = 3; i < argc; i++) {
-        if (count == MALLOC_SIZE) {
-            paths = realloc(paths, new_size);
-            count = 0;
-            new_size += MALLOC_SIZE;
-        }
-        paths[i - 3] = argv[i];
-        count++;
-        path_count++;
-    }
-
-    paths_copy = malloc(path_count);
-    for(i = 0; i < path_count; i++) {
-        paths_copy[i] = strdup(paths[i]);
+    /* - is standard input or output, which can't be indexed or
+     * appended to */
+    if (strcmp(tarfile, "-") == 0 && (i_flag == 1 || r_flag == 1)) {
+        fprintf(stderr, "can't index or append to standard i/o\n");
+        exit(2);
     }
 
-    if (path_count > 0) {
-        supplied_path = 1;
-        for(i = 0; i < path_count; i++) {
-            path_substring = strtok(paths[i], "/");
-            if(strcmp(path_substring, paths_copy[i]) == 0)
-                continue;
-            printf("HeRE: %s\n", path_substring);
-            mkdir(path_substring, S_IRUSR | S_IWUSR
-                          | S_IXUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-            while((new_path_piece = strtok(NULL, "/")) != NULL) {
-                strcat(path_substring, "/\0");
-                strcat(path_substring, new_path_piece);
+    /* options may appear anywhere after the tarfile. getopt sees the
+     * tarfile as argv[0] and moves the paths to the end for us */
+    opterr = 0;
+    while ((opt = getopt(argc - 2, argv + 2, OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'b':
+            record_size = parse_number(optarg);
+            if (record_size == 0 || record_size > MAX_RECORD / BLOCK_SIZE) {
+                fprintf(stderr, "bad blocking factor: %s\n", optarg);
+                exit(2);
+            }
+            record_size *= BLOCK_SIZE;
+            whole_records = 1;
+            break;
+        case 'B':
+            copy_bufsize = parse_size(optarg);
+            break;
+        case 'O':
+            direct_io = 1;
+            break;
+        case 'R':
+            sort_names = 1;
+            break;
+        case 'N':
+            subsec_mtime = 1;
+            break;
+        case 'D':
+            dedup = 1;
+            break;
+        case 'g':
+            snapshot_file = optarg;
+            break;
+        case 'G':
+            purge_dirs = 1;
+            break;
+        case 'm':
+        case 'M':
+            mtime_mode = opt;
+            mtime_value = parse_number(optarg);
+            break;
+        case 'u':
+            parse_owner(optarg, &owner_uid, &owner_gid);
+            break;
+        case 'U':
+            split_owner(optarg, &owner_uname, &owner_gname);
+            /* no longer than a name from the user database, so
+             * the records makeHeader builds for them fit */
+            if ((owner_uname != NULL
+                 && strlen(owner_uname) >= NAME_BUF_SIZE)
+                || (owner_gname != NULL
+                    && strlen(owner_gname) >= NAME_BUF_SIZE)) {
+                fprintf(stderr, "owner name is too long\n");
+                exit(2);
             }
+            break;
+        case 'Z':
+            if ((out_codec = find_codec(optarg)) == NULL) {
+                fprintf(stderr, "unknown compression: %s\n", optarg);
+                exit(2);
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(stderr, "bad job count: %s\n", optarg);
+                exit(2);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(2);
         }
     }
+    paths = argv + 2 + optind;
+    path_count = argc - 2 - optind;
 
-
-    /*
-    for (i = 0; i < path_count; i++) {
-        printf("%s\n", paths_copy[i]);
-    }
-     */
     if(c_flag == 1){
         create_archive(tarfile, paths, path_count);
     }
 
+    /*appending keeps the index up to date itself*/
+    if(r_flag == 1){
+        append_archive(tarfile, paths, path_count, u_flag);
+    }
+
+    if(i_flag == 1 && r_flag == 0){
+        index_archive(tarfile);
+    }
+
     if(t_flag == 1){
         print_archive(tarfile, paths, path_count);
     }
 
     if (x_flag == 1) {
-        extract_archive(tarfile, paths_copy, supplied_path, path_count);
+        extract_archive(tarfile, paths, path_count > 0, path_count);
     }
 
-    free(paths);
     return 0;
 }
@@ -0,0 +1,46 @@
+#!/bin/sh
+# names too long for the ustar fields go in pax path and linkpath
+# records: a long last part that can't be split into prefix and name,
+# and a hard link to one, both ways round. run from the top directory
+# after make, or with make check
+
+MYTAR=${MYTAR:-$PWD/mytar}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+LONG=$(printf '%0140d' 0 | tr 0 b)
+fail=0
+
+check() {
+    if [ "$1" != "$2" ]; then
+        echo "FAIL: $3: got '$1', expected '$2'"
+        fail=1
+    fi
+}
+
+cd "$DIR" || exit 1
+mkdir ln
+echo first > "ln/a$LONG"
+ln "ln/a$LONG" ln/link
+echo second > ln/file
+ln ln/file "ln/z$LONG"
+
+"$MYTAR" cf a.tar ln -R || exit 1
+check "$("$MYTAR" tf a.tar | sort | tr '\n' ' ')" \
+    "ln/ ln/a$LONG ln/file ln/link ln/z$LONG " "listing"
+
+mkdir out
+(cd out && "$MYTAR" xf ../a.tar) || exit 1
+check "$(cat "out/ln/a$LONG")" first "long basename"
+check "$(cat out/ln/link)" first "link to a long basename"
+check "$(cat "out/ln/z$LONG")" second "long link to a short name"
+check "$(stat -c %h "out/ln/a$LONG")" 2 "links to the long basename"
+check "$(stat -c %h out/ln/file)" 2 "links to the short name"
+
+# other tars see the same names
+if command -v tar > /dev/null; then
+    check "$(tar tf a.tar | sort | tr '\n' ' ')" \
+        "ln/ ln/a$LONG ln/file ln/link ln/z$LONG " "tar listing"
+fi
+
+[ $fail = 0 ] && echo "long_names: ok"
+exit $fail
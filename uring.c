@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "uring.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* the steps of a file's chain, kept in the low bits of user_data */
+#define STEP_OPEN 0
+#define STEP_RW 1
+#define STEP_CLOSE 2
+#define STEP_MASK 3UL
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+/* a ring and the fixed file slots files are opened into. each file
+ * in flight has a slot of its own, so depth files can be in flight */
+struct uring
+{
+        int fd;
+        int depth;
+        int inflight;
+        /* our copy of the submission tail, and how many sqes behind
+         * it the kernel has yet to take */
+        unsigned sq_local;
+        unsigned unsubmitted;
+        int *free_slots;
+        int nfree;
+
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_map;
+        size_t sq_len;
+        void *cq_map;
+        size_t cq_len;
+        size_t sqes_len;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait,
+                      unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned op, void *arg, unsigned n) {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* whether the kernel can do everything a file's chain needs,
+ * opening and closing into fixed slots included. those came with
+ * linkat, which can be asked about where they can't */
+static int has_ops(int fd) {
+    static const int needed[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_CLOSE, IORING_OP_LINKAT
+    };
+    struct io_uring_probe *probe;
+    size_t i;
+    int ok;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+    if (probe == NULL) {
+        return 0;
+    }
+    ok = ring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op
+             && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+/* a ring for depth files at once, or NULL when the kernel doesn't
+ * have io_uring, won't let us use it or is too old to open files
+ * into fixed slots */
+uring *uring_open(int depth) {
+    struct io_uring_params p;
+    uring *r = calloc(1, sizeof(uring));
+    void *map;
+    int i;
+
+    if (r == NULL) {
+        return NULL;
+    }
+    r->sq_map = r->cq_map = r->sqes = MAP_FAILED;
+    r->depth = depth;
+    memset(&p, 0, sizeof(p));
+    r->free_slots = malloc(depth * sizeof(int));
+    if (r->free_slots == NULL
+        || (r->fd = ring_setup(depth * 3, &p)) == -1) {
+        free(r->free_slots);
+        free(r);
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = 0;
+    }
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map != MAP_FAILED && r->cq_len == 0) {
+        r->cq_map = r->sq_map;
+    } else if (r->sq_map != MAP_FAILED) {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED
+        || r->sqes == MAP_FAILED || !has_ops(r->fd)) {
+        uring_close(r);
+        return NULL;
+    }
+
+    map = r->sq_map;
+    r->sq_tail = (unsigned *) ((char *) map + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) map + p.sq_off.array);
+    r->sq_local = *r->sq_tail;
+    map = r->cq_map;
+    r->cq_head = (unsigned *) ((char *) map + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) map + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) map + p.cq_off.cqes);
+
+    /* an empty table of slots for files to be opened into */
+    for (i = 0; i < depth; i++) {
+        r->free_slots[i] = -1;
+    }
+    if (ring_register(r->fd, IORING_REGISTER_FILES, r->free_slots,
+                      depth) == -1) {
+        uring_close(r);
+        return NULL;
+    }
+    for (i = 0; i < depth; i++) {
+        r->free_slots[i] = depth - 1 - i;
+    }
+    r->nfree = depth;
+    return r;
+}
+
+void uring_close(uring *r) {
+    if (r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_len);
+    }
+    if (r->sq_map != MAP_FAILED) {
+        munmap(r->sq_map, r->sq_len);
+    }
+    close(r->fd);
+    free(r->free_slots);
+    free(r);
+}
+
+/* room for another file */
+int uring_room(uring *r) {
+    return r->nfree > 0;
+}
+
+static struct io_uring_sqe *next_sqe(uring *r, uring_file *f, int step) {
+    unsigned i = r->sq_local++ & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long) f | step;
+    r->sq_array[i] = i;
+    r->unsubmitted++;
+    return sqe;
+}
+
+/* queue f's chain. nothing goes to the kernel until uring_wait.
+ * returns -1 if there's no room */
+int uring_submit(uring *r, uring_file *f) {
+    struct io_uring_sqe *sqe;
+
+    if (r->nfree == 0) {
+        return -1;
+    }
+    f->slot = r->free_slots[--r->nfree];
+    f->open_res = f->close_res = 0;
+    f->rw_res = 0;
+    f->pending = f->len > 0 ? 3 : 2;
+
+    sqe = next_sqe(r, f, STEP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) f->path;
+    sqe->len = f->mode;
+    sqe->open_flags = f->flags;
+    sqe->file_index = f->slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    if (f->len > 0) {
+        sqe = next_sqe(r, f, STEP_RW);
+        sqe->opcode = f->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = f->slot;
+        sqe->addr = (unsigned long) f->buf;
+        sqe->len = f->len;
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    }
+
+    sqe = next_sqe(r, f, STEP_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = f->slot + 1;
+
+    r->inflight++;
+    return 0;
+}
+
+/* give f's slot back. a failed or short read or write cancels the
+ * close after it, so the file is closed by clearing its slot */
+static void release_slot(uring *r, uring_file *f) {
+    struct io_uring_files_update up;
+    int none = -1;
+
+    if (f->open_res >= 0 && f->close_res < 0) {
+        memset(&up, 0, sizeof(up));
+        up.offset = f->slot;
+        up.fds = (unsigned long) &none;
+        ring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    }
+    r->free_slots[r->nfree++] = f->slot;
+    r->inflight--;
+}
+
+/* hand what's queued to the kernel without waiting */
+void uring_kick(uring *r) {
+    int n;
+
+    if (r->unsubmitted == 0) {
+        return;
+    }
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    if ((n = ring_enter(r->fd, r->unsubmitted, 0, 0)) > 0) {
+        r->unsubmitted -= n;
+    }
+}
+
+/* the next file whose chain has finished, waiting for one if need
+ * be. NULL when nothing is in flight */
+uring_file *uring_wait(uring *r) {
+    struct io_uring_cqe *cqe;
+    uring_file *f;
+    unsigned head;
+    int n;
+
+    while (r->inflight > 0) {
+        head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            f = (uring_file *) (unsigned long) (cqe->user_data
+                                                & ~STEP_MASK);
+            switch (cqe->user_data & STEP_MASK) {
+            case STEP_OPEN:
+                f->open_res = cqe->res;
+                break;
+            case STEP_RW:
+                f->rw_res = cqe->res;
+                break;
+            default:
+                f->close_res = cqe->res;
+            }
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            if (--f->pending == 0) {
+                release_slot(r, f);
+                return f;
+            }
+            continue;
+        }
+
+        /* publish what's queued, submit it and wait */
+        __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+        n = ring_enter(r->fd, r->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (n == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0) {
+            r->unsubmitted -= n;
+        }
+    }
+    return NULL;
+}
+
+#else
+
+/* no io_uring here, everything takes the synchronous path */
+uring *uring_open(int depth) {
+    return NULL;
+}
+
+void uring_close(uring *r) {
+}
+
+int uring_room(uring *r) {
+    return 0;
+}
+
+int uring_submit(uring *r, uring_file *f) {
+    return -1;
+}
+
+void uring_kick(uring *r) {
+}
+
+uring_file *uring_wait(uring *r) {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ASGN4_URING_H
+#define ASGN4_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* a file opened, read or written in full, and closed by the kernel as
+ * one chain of requests, so many small files cost a few system calls
+ * between them instead of three each */
+typedef struct
+{
+        const char *path;
+        int flags;
+        mode_t mode;
+        /* write buf out, else read into it */
+        int write;
+        void *buf;
+        size_t len;
+        void *user;
+        /* results, -errno on failure. a step after a failed one is
+         * -ECANCELED */
+        int open_res;
+        long rw_res;
+        int close_res;
+        /* private to the ring */
+        int slot;
+        int pending;
+} uring_file;
+
+typedef struct uring uring;
+
+uring *uring_open(int depth);
+
+void uring_close(uring *r);
+
+int uring_room(uring *r);
+
+int uring_submit(uring *r, uring_file *f);
+
+void uring_kick(uring *r);
+
+uring_file *uring_wait(uring *r);
+
+#endif